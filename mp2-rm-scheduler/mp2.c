@@ -9,8 +9,17 @@
 #include <linux/slab.h>
 #include <linux/timer.h>
 #include <linux/kthread.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/wait.h>
+#include <linux/cpumask.h>
+#include <linux/seq_file.h>
 
 #include "mp2_given.h"
+#include "mp2_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("LUOJL");
@@ -18,35 +27,211 @@ MODULE_DESCRIPTION("CS-423 MP2");
 
 #define FILENAME "status"
 #define DIRECTORY "mp2"
-#define READ_BUFSIZE  512
 #define WRITE_BUFSIZE 512
 #define STATE_SLEEPING 0
 #define STATE_READY 1
 #define STATE_RUNNING 2
+#define TASK_PERIODIC 0
+#define TASK_SERVER 1
+#define TRACE_CLASS_NAME "mp2_dev"
+#define UTIL_BOUND 6930  // ln 2, scaled by 10000
+#define MAX_RESOURCES 32
 
 static struct proc_dir_entry *proc_dir;
 static struct proc_dir_entry *proc_entry;
 
 static DEFINE_MUTEX(RMS_tasks_lock);
 static DEFINE_MUTEX(running_task_lock);
+static DEFINE_SPINLOCK(server_lock);
+// Writes of prio_period_ms, and reads of period_ms to compute it, also come from the server's timer
+static DEFINE_SPINLOCK(prio_lock);
 static LIST_HEAD(tasks_list);
 
 static struct task_struct *dispatcher;
 
+static char *housekeeping_cpus = "";
+module_param(housekeeping_cpus, charp, 0444);
+MODULE_PARM_DESC(housekeeping_cpus, "CPU list for the dispatcher and timers, e.g. 0");
+static char *isolated_cpus = "";
+module_param(isolated_cpus, charp, 0444);
+MODULE_PARM_DESC(isolated_cpus, "CPU list admitted tasks are pinned to, e.g. 1-3");
+
+// Empty when the corresponding parameter isn't given
+static struct cpumask housekeeping_mask;
+static struct cpumask isolated_mask;
+
+static void *trace_buf;
+static unsigned long trace_stride;
+static unsigned long trace_bufsize;
+static int dev_major;
+static struct class *dev_class = NULL;
+static struct device *trace_dev = NULL;
+
 // RMS: Rate-Monotonic CPU Scheduler
 typedef struct RMS_task_struct {
     struct task_struct* linux_task;
     struct timer_list wakeup_timer;
     struct list_head lis;
     int state;
+    int type;
     pid_t pid;
     unsigned long period_ms;
-    unsigned long compute_time_ms;
+    unsigned long compute_time_ms;  // budget for a server
     unsigned long deadline_jiff;
+
+    // Priority ceiling protocol, protected by RMS_tasks_lock, prio_period_ms is written under prio_lock
+    unsigned long prio_period_ms;   // effective priority, period or ceiling
+    unsigned long cs_ms[MAX_RESOURCES];  // declared critical sections, 0 if unused
+    unsigned long held;             // bitmask of held resources
+
+    int pinned;                     // affinity set to isolated_mask
+    struct cpumask saved_mask;      // affinity before pinning, restored by unpin_task
+
+    // Pending mode change, takes effect for the period released at
+    // mode_change_jiff. Protected by RMS_tasks_lock, or server_lock for a server.
+    int mode_change;
+    unsigned long new_period_ms;
+    unsigned long new_compute_time_ms;
+    unsigned long mode_change_jiff;
+
+    // Deferrable server only, budget fields are protected by server_lock
+    struct timer_list budget_timer;
+    unsigned long budget_jiff;      // remaining budget in this period
+    unsigned long run_start_jiff;
+    int pending_jobs;
+    int in_job;
 } RMS_task;
 
 RMS_task* running_task;
 
+// Timers fire on a housekeeping CPU, if any, instead of the CPU that armed them
+void arm_timer(struct timer_list *timer, unsigned long expires) {
+    if (cpumask_empty(&housekeeping_mask)) {
+        mod_timer(timer, expires);
+        return;
+    }
+    del_timer(timer);
+    timer->expires = expires;
+    add_timer_on(timer, cpumask_first(&housekeeping_mask));
+}
+
+void pin_task(RMS_task *task) {
+    task->pinned = 0;
+    if (cpumask_empty(&isolated_mask)) {
+        return;
+    }
+    cpumask_copy(&task->saved_mask, tsk_cpus_allowed(task->linux_task));
+    if (set_cpus_allowed_ptr(task->linux_task, &isolated_mask)) {
+        printk(KERN_ALERT "[WARN] fail to pin pid %d to isolated cpus", task->pid);
+        return;
+    }
+    task->pinned = 1;
+}
+
+void unpin_task(RMS_task *task) {
+    if (task->pinned) {
+        set_cpus_allowed_ptr(task->linux_task, &task->saved_mask);
+        task->pinned = 0;
+    }
+}
+
+int parse_cpus(const char *name, const char *list, struct cpumask *mask) {
+    cpumask_clear(mask);
+    if (list == NULL || list[0] == '\0') {
+        return 0;
+    }
+    if (cpulist_parse(list, mask) || !cpumask_subset(mask, cpu_online_mask) || cpumask_empty(mask)) {
+        printk(KERN_ALERT "[Err] invalid %s: %s", name, list);
+        cpumask_clear(mask);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+// A shared resource locked through the proc file, owner is protected by RMS_tasks_lock
+typedef struct RMS_resource {
+    RMS_task *owner;
+    wait_queue_head_t wait;
+} RMS_resource;
+
+static RMS_resource resources[MAX_RESOURCES];
+
+// Caller holds RMS_tasks_lock
+unsigned long __resource_ceiling(int rid) {
+    RMS_task *task;
+    unsigned long ceiling = ULONG_MAX;
+    list_for_each_entry(task, &tasks_list, lis) {
+        if (task->cs_ms[rid] && task->period_ms < ceiling) {
+            ceiling = task->period_ms;
+        }
+    }
+    return ceiling;
+}
+
+// Caller holds RMS_tasks_lock
+void __update_prio(RMS_task *task) {
+    unsigned long prio = ULONG_MAX;
+    unsigned long flags;
+    int rid;
+    for (rid = 0; rid < MAX_RESOURCES; rid++) {
+        if (task->held & (1UL << rid)) {
+            prio = min(prio, __resource_ceiling(rid));
+        }
+    }
+    spin_lock_irqsave(&prio_lock, flags);
+    task->prio_period_ms = min(prio, task->period_ms);
+    spin_unlock_irqrestore(&prio_lock, flags);
+}
+
+// Caller holds RMS_tasks_lock
+void __release_resources(RMS_task *task) {
+    unsigned long flags;
+    int rid;
+    for (rid = 0; rid < MAX_RESOURCES; rid++) {
+        if (task->held & (1UL << rid)) {
+            resources[rid].owner = NULL;
+            wake_up_interruptible(&resources[rid].wait);
+        }
+    }
+    task->held = 0;
+    spin_lock_irqsave(&prio_lock, flags);
+    task->prio_period_ms = task->period_ms;
+    spin_unlock_irqrestore(&prio_lock, flags);
+}
+
+/*
+ * Append an event to the ring of the current CPU. Interrupts are off so a
+ * timer callback can't interleave with a process context writer, and each
+ * CPU only writes its own ring, so no lock is needed.
+ */
+void trace_event(int type, pid_t pid, unsigned long arg) {
+    struct trace_ring *ring;
+    struct trace_event *ev;
+    unsigned long flags;
+    u64 seq;
+    int cpu;
+
+    if (trace_buf == NULL) {
+        return;
+    }
+    local_irq_save(flags);
+    cpu = smp_processor_id();
+    ring = trace_buf + PAGE_SIZE + cpu * trace_stride;
+    seq = ring->head;
+    ev = &ring->events[seq & (TRACE_RING_SIZE - 1)];
+    ev->seq = ~0ULL;  // invalid while being rewritten
+    smp_wmb();
+    ev->ts_ns = ktime_get_ns();
+    ev->pid = pid;
+    ev->type = type;
+    ev->cpu = cpu;
+    ev->arg = arg;
+    smp_wmb();
+    ev->seq = seq;
+    smp_store_release(&ring->head, seq + 1);
+    local_irq_restore(flags);
+}
+
 void __add_task(RMS_task *task) {
     mutex_lock(&RMS_tasks_lock);
     list_add(&(task->lis), &tasks_list);
@@ -92,26 +277,32 @@ RMS_task* __get_to_run_task(void) {
     unsigned long min_period = INT_MAX;
     mutex_lock(&RMS_tasks_lock);
     list_for_each_entry(tmp, &tasks_list, lis) {
-        if (tmp->state == STATE_READY && tmp->period_ms < min_period) {
+        if (tmp->state == STATE_READY && READ_ONCE(tmp->prio_period_ms) < min_period) {
             task = tmp;
-            min_period = tmp->period_ms;
+            min_period = READ_ONCE(tmp->prio_period_ms);
         }
     }
     mutex_unlock(&RMS_tasks_lock);
     return task;
 }
 
+// The timers are stopped without the lock, a callback still running elsewhere may need it
 void free_all_tasks(void) {
     RMS_task *task;
     struct list_head *ptr, *tmp;
+    LIST_HEAD(dead);
     mutex_lock(&RMS_tasks_lock);
-    list_for_each_safe(ptr, tmp, &tasks_list) {
+    list_splice_init(&tasks_list, &dead);
+    mutex_unlock(&RMS_tasks_lock);
+    list_for_each_safe(ptr, tmp, &dead) {
         task = list_entry(ptr, RMS_task, lis);
-        del_timer(&(task->wakeup_timer));
+        del_timer_sync(&(task->wakeup_timer));
+        if (task->type == TASK_SERVER) {
+            del_timer_sync(&(task->budget_timer));
+        }
         list_del(ptr);
         kfree(task);
     }
-    mutex_unlock(&RMS_tasks_lock);
 }
 
 void __timer_callback(unsigned long data) {
@@ -128,22 +319,105 @@ void __timer_callback(unsigned long data) {
         return;
     }
     task->state = STATE_READY;
+    trace_event(TRACE_RELEASE, pid, task->period_ms);
     wake_up_process(dispatcher);
 }
 
+// Caller holds server_lock
+void __charge_budget(RMS_task *task) {
+    unsigned long used = jiffies - task->run_start_jiff;
+    task->budget_jiff = used >= task->budget_jiff ? 0 : task->budget_jiff - used;
+    task->run_start_jiff = jiffies;
+}
+
+// Deferrable server: the budget is refilled at every period boundary
+void __replenish_callback(unsigned long data) {
+    RMS_task *task = (RMS_task *) data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&server_lock, flags);
+    if (task->mode_change) {
+        spin_lock(&prio_lock);
+        task->period_ms = task->new_period_ms;
+        task->compute_time_ms = task->new_compute_time_ms;
+        task->mode_change = 0;
+        // ceilings can't be looked up here, the next unlock recomputes it
+        if (task->held) {
+            task->prio_period_ms = min(task->prio_period_ms, task->period_ms);
+        } else {
+            task->prio_period_ms = task->period_ms;
+        }
+        spin_unlock(&prio_lock);
+        trace_event(TRACE_MODE, task->pid, task->period_ms);
+    }
+    task->budget_jiff = msecs_to_jiffies(task->compute_time_ms);
+    if (task->state == STATE_RUNNING) {
+        task->run_start_jiff = jiffies;
+        arm_timer(&(task->budget_timer), jiffies + task->budget_jiff);
+    } else if (task->pending_jobs > 0) {
+        task->state = STATE_READY;
+    }
+    spin_unlock_irqrestore(&server_lock, flags);
+    trace_event(TRACE_RELEASE, task->pid, task->period_ms);
+
+    task->deadline_jiff += msecs_to_jiffies(task->period_ms);
+    arm_timer(&(task->wakeup_timer), task->deadline_jiff);
+    wake_up_process(dispatcher);
+}
+
+// The running server used up its budget, the dispatcher will take the CPU back
+void __budget_callback(unsigned long data) {
+    RMS_task *task = (RMS_task *) data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&server_lock, flags);
+    if (task->state == STATE_RUNNING) {
+        task->budget_jiff = 0;
+        task->state = STATE_SLEEPING;
+        trace_event(TRACE_EXHAUST, task->pid, 0);
+    }
+    spin_unlock_irqrestore(&server_lock, flags);
+    wake_up_process(dispatcher);
+}
+
+void demote_task(RMS_task *task) {
+    struct sched_param sparam;
+    sparam.sched_priority = 0;
+    sched_setscheduler(task->linux_task, SCHED_NORMAL, &sparam);
+}
+
 void run_task(RMS_task *task) {
     struct sched_param sparam;
-    task->state = STATE_RUNNING;
+    unsigned long flags;
+    if (task->type == TASK_SERVER) {
+        spin_lock_irqsave(&server_lock, flags);
+        task->state = STATE_RUNNING;
+        task->run_start_jiff = jiffies;
+        task->in_job = 1;
+        arm_timer(&(task->budget_timer), jiffies + task->budget_jiff);
+        spin_unlock_irqrestore(&server_lock, flags);
+    } else {
+        task->state = STATE_RUNNING;
+    }
+    trace_event(TRACE_DISPATCH, task->pid, 0);
     wake_up_process(task->linux_task);
     sparam.sched_priority = 99;
     sched_setscheduler(task->linux_task, SCHED_FIFO, &sparam);
 }
 
 void preempt_task(RMS_task *task) {
-    struct sched_param sparam;
-    task->state = STATE_READY;
-    sparam.sched_priority = 0;
-    sched_setscheduler(task->linux_task, SCHED_NORMAL, &sparam);
+    unsigned long flags;
+    if (task->type == TASK_SERVER) {
+        spin_lock_irqsave(&server_lock, flags);
+        del_timer(&(task->budget_timer));
+        __charge_budget(task);
+        task->state = task->budget_jiff > 0 ? STATE_READY : STATE_SLEEPING;
+        spin_unlock_irqrestore(&server_lock, flags);
+    } else {
+        task->state = STATE_READY;
+    }
+    trace_event(TRACE_PREEMPT, task->pid, 0);
+    demote_task(task);
 }
 
 int dispatching(void *data) {
@@ -151,17 +425,29 @@ int dispatching(void *data) {
 
     while (1) {
         set_current_state(TASK_INTERRUPTIBLE);
+        // checked after the state is set, so a kthread_stop from here on wakes us
+        if (kthread_should_stop()) {
+            __set_current_state(TASK_RUNNING);
+            return 0;
+        }
         schedule();
 
         if (kthread_should_stop()) return 0;
 
-        task_to_run = __get_to_run_task();
-
         mutex_lock(&running_task_lock);
+        if (running_task && running_task->state != STATE_RUNNING) {
+            // a server ran out of budget
+            trace_event(TRACE_PREEMPT, running_task->pid, 0);
+            demote_task(running_task);
+            running_task = NULL;
+        }
+
+        task_to_run = __get_to_run_task();
         if (task_to_run != NULL) {
             if (running_task == NULL) {
                 run_task(task_to_run);
-            } else if (running_task->period_ms > task_to_run->period_ms) {
+                running_task = task_to_run;
+            } else if (READ_ONCE(running_task->prio_period_ms) > READ_ONCE(task_to_run->prio_period_ms)) {
                 // Preempt
                 preempt_task(running_task);
                 run_task(task_to_run);
@@ -172,9 +458,81 @@ int dispatching(void *data) {
     }
 }
 
-int admission_control(unsigned long period, unsigned computation) {
+/*
+ * A deferrable server may run its budget at the end of one period and again
+ * at the start of the next. It never interferes more than a periodic task
+ * with twice its budget, so that is what admission control charges it.
+ */
+unsigned long task_demand(RMS_task *task, unsigned long computation) {
+    if (task->type == TASK_SERVER) {
+        return 2 * computation;
+    }
+    return computation;
+}
+
+// Until a mode change is applied, charge whichever of the two modes is heavier
+unsigned long task_portion(RMS_task *task) {
+    unsigned long portion, new_portion;
+    portion = (task_demand(task, task->compute_time_ms) * 10000) / task->period_ms;
+    if (task->mode_change) {
+        new_portion = (task_demand(task, task->new_compute_time_ms) * 10000) / task->new_period_ms;
+        portion = max(portion, new_portion);
+    }
+    return portion;
+}
+
+typedef struct admission_entry {
+    unsigned long period_ms;
+    unsigned long portion;
+    unsigned long *cs_ms;  // NULL if the task uses no resource
+} admission_entry;
+
+/*
+ * Under the priority ceiling protocol a job is blocked at most once, by the
+ * longest critical section B_i of a lower priority task on a resource whose
+ * ceiling is at least its own priority. Each task must meet the bound with
+ * the utilization of tasks of higher or equal priority plus B_i / T_i.
+ */
+int blocking_check(admission_entry *entries, int n) {
+    unsigned long ceilings[MAX_RESOURCES];
+    unsigned long portion, blocking;
+    int i, j, rid;
+
+    for (rid = 0; rid < MAX_RESOURCES; rid++) {
+        ceilings[rid] = ULONG_MAX;
+        for (i = 0; i < n; i++) {
+            if (entries[i].cs_ms && entries[i].cs_ms[rid]) {
+                ceilings[rid] = min(ceilings[rid], entries[i].period_ms);
+            }
+        }
+    }
+    for (i = 0; i < n; i++) {
+        portion = 0;
+        blocking = 0;
+        for (j = 0; j < n; j++) {
+            if (entries[j].period_ms <= entries[i].period_ms) {
+                portion += entries[j].portion;
+            } else if (entries[j].cs_ms) {
+                for (rid = 0; rid < MAX_RESOURCES; rid++) {
+                    if (entries[j].cs_ms[rid] && ceilings[rid] <= entries[i].period_ms) {
+                        blocking = max(blocking, entries[j].cs_ms[rid]);
+                    }
+                }
+            }
+        }
+        if (portion + (blocking * 10000) / entries[i].period_ms > UTIL_BOUND) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// exclude: a registered task whose current parameters are being replaced
+int admission_control(unsigned long period, unsigned long computation, RMS_task *exclude) {
     RMS_task *task;
+    admission_entry *entries;
     unsigned long portion;
+    int n = 1, pass;
 
     if (period == 0 || computation == 0) {
         return 0;
@@ -183,39 +541,151 @@ int admission_control(unsigned long period, unsigned computation) {
 
     mutex_lock(&RMS_tasks_lock);
     list_for_each_entry(task, &tasks_list, lis) {
-        portion += (task->compute_time_ms * 10000) / task->period_ms;
+        n++;
     }
-    mutex_unlock(&RMS_tasks_lock);
-    if (portion <= 6930) {
-        return 1; // pass
+    entries = kmalloc(n * sizeof(admission_entry), GFP_KERNEL);
+    if (entries == NULL) {
+        mutex_unlock(&RMS_tasks_lock);
+        return 0;
+    }
+    entries[0].period_ms = period;
+    entries[0].portion = portion;
+    entries[0].cs_ms = exclude ? exclude->cs_ms : NULL;
+    n = 1;
+    list_for_each_entry(task, &tasks_list, lis) {
+        if (task != exclude) {
+            entries[n].period_ms = task->period_ms;
+            entries[n].portion = task_portion(task);
+            entries[n].cs_ms = task->cs_ms;
+            portion += entries[n].portion;
+            n++;
+        }
     }
-    return 0;  // fail
+    pass = portion <= UTIL_BOUND && blocking_check(entries, n);
+    mutex_unlock(&RMS_tasks_lock);
+    kfree(entries);
+    return pass;
 }
 
-void action_register(pid_t pid, unsigned long period, unsigned long computation) {
+int action_register(pid_t pid, unsigned long period, unsigned long computation) {
     RMS_task *t;
     struct task_struct *ts;
 
-    if (admission_control(period, computation) == 0) {
+    if (admission_control(period, computation, NULL) == 0) {
         printk(KERN_ALERT "process %d failed to pass admission_control", pid);
-        return;
+        return 0;
     }
-    t = (RMS_task *) kmalloc(sizeof(RMS_task), GFP_KERNEL);
     ts = find_task_by_pid(pid);
+    if (ts == NULL) {
+        printk(KERN_ALERT "[Err] no such process to register, pid: %d", pid);
+        return -ESRCH;
+    }
+    t = (RMS_task *) kmalloc(sizeof(RMS_task), GFP_KERNEL);
+    if (t == NULL) {
+        return -ENOMEM;
+    }
     printk(KERN_ALERT "registration, pid: %d, period: %lu, computation: %lu", pid, period, computation);
     t->pid = pid;
     t->linux_task = ts;
     t->state = STATE_SLEEPING;
+    t->type = TASK_PERIODIC;
+    t->mode_change = 0;
     t->period_ms = period;
+    t->prio_period_ms = period;
+    memset(t->cs_ms, 0, sizeof(t->cs_ms));
+    t->held = 0;
     t->compute_time_ms = computation;
     t->deadline_jiff = jiffies;
+    pin_task(t);
     __add_task(t);
+    trace_event(TRACE_REGISTER, pid, period);
     setup_timer(&t->wakeup_timer, __timer_callback, ts->pid);
+    return 0;
+}
+
+int action_register_server(pid_t pid, unsigned long period, unsigned long budget) {
+    RMS_task *t;
+    struct task_struct *ts;
+
+    if (budget > period || admission_control(period, 2 * budget, NULL) == 0) {
+        printk(KERN_ALERT "server %d failed to pass admission_control", pid);
+        return 0;
+    }
+    ts = find_task_by_pid(pid);
+    if (ts == NULL) {
+        printk(KERN_ALERT "[Err] no such process to serve, pid: %d", pid);
+        return -ESRCH;
+    }
+    t = (RMS_task *) kmalloc(sizeof(RMS_task), GFP_KERNEL);
+    if (t == NULL) {
+        return -ENOMEM;
+    }
+    printk(KERN_ALERT "server registration, pid: %d, period: %lu, budget: %lu", pid, period, budget);
+    t->pid = pid;
+    t->linux_task = ts;
+    t->state = STATE_SLEEPING;
+    t->type = TASK_SERVER;
+    t->mode_change = 0;
+    t->period_ms = period;
+    t->prio_period_ms = period;
+    memset(t->cs_ms, 0, sizeof(t->cs_ms));
+    t->held = 0;
+    t->compute_time_ms = budget;
+    t->budget_jiff = msecs_to_jiffies(budget);
+    t->run_start_jiff = jiffies;
+    t->pending_jobs = 0;
+    t->in_job = 0;
+    pin_task(t);
+    setup_timer(&t->wakeup_timer, __replenish_callback, (unsigned long) t);
+    setup_timer(&t->budget_timer, __budget_callback, (unsigned long) t);
+    __add_task(t);
+    trace_event(TRACE_REGISTER, pid, period);
+
+    t->deadline_jiff = jiffies + msecs_to_jiffies(period);
+    arm_timer(&(t->wakeup_timer), t->deadline_jiff);
+    return 0;
+}
+
+// Queue one aperiodic job to a server, its handler runs once there is budget
+void action_job(pid_t pid) {
+    RMS_task *task = __get_task(pid);
+    unsigned long flags;
+
+    if (task == NULL || task->type != TASK_SERVER) {
+        printk(KERN_ALERT "[Err] no such server to queue job, pid: %d", pid);
+        return;
+    }
+    spin_lock_irqsave(&server_lock, flags);
+    task->pending_jobs++;
+    if (task->state == STATE_SLEEPING && task->budget_jiff > 0) {
+        task->state = STATE_READY;
+    }
+    spin_unlock_irqrestore(&server_lock, flags);
+    trace_event(TRACE_JOB, pid, 0);
+    wake_up_process(dispatcher);
+}
+
+// Caller holds server_lock. The handler finished its job.
+void __server_yield(RMS_task *task) {
+    if (task->state == STATE_RUNNING) {
+        del_timer(&(task->budget_timer));
+        __charge_budget(task);
+    }
+    if (task->in_job) {
+        task->pending_jobs--;
+        task->in_job = 0;
+    }
+    if (task->pending_jobs > 0 && task->budget_jiff > 0) {
+        task->state = STATE_READY;
+    } else {
+        task->state = STATE_SLEEPING;
+    }
 }
 
 void action_yield(pid_t pid) {
     RMS_task *task;
     unsigned long next_deadline_jiff;
+    unsigned long flags;
     if (running_task && running_task->pid == pid) {
         task = running_task;
     } else {
@@ -226,21 +696,197 @@ void action_yield(pid_t pid) {
         return;
     }
 
-    next_deadline_jiff = task->deadline_jiff + msecs_to_jiffies(task->period_ms);
-    mod_timer(&(task->wakeup_timer), next_deadline_jiff);
-    task->deadline_jiff = next_deadline_jiff;
-
     mutex_lock(&running_task_lock);
     if (running_task && running_task->pid == pid) {
         running_task = NULL;
     }
     mutex_unlock(&running_task_lock);
-    task->state = STATE_SLEEPING;
+    trace_event(TRACE_YIELD, pid, 0);
+
+    if (task->type == TASK_SERVER) {
+        spin_lock_irqsave(&server_lock, flags);
+        __server_yield(task);
+        spin_unlock_irqrestore(&server_lock, flags);
+    } else {
+        mutex_lock(&RMS_tasks_lock);
+        if (task->mode_change && time_after_eq(task->deadline_jiff, task->mode_change_jiff)) {
+            task->period_ms = task->new_period_ms;
+            task->compute_time_ms = task->new_compute_time_ms;
+            task->mode_change = 0;
+            __update_prio(task);
+            printk(KERN_ALERT "mode changed, pid: %d, period: %lu, computation: %lu",
+                   pid, task->period_ms, task->compute_time_ms);
+            trace_event(TRACE_MODE, pid, task->period_ms);
+        }
+        mutex_unlock(&RMS_tasks_lock);
+        next_deadline_jiff = task->deadline_jiff + msecs_to_jiffies(task->period_ms);
+        arm_timer(&(task->wakeup_timer), next_deadline_jiff);
+        task->deadline_jiff = next_deadline_jiff;
+        task->state = STATE_SLEEPING;
+    }
     wake_up_process(dispatcher);
     set_task_state(task->linux_task, TASK_INTERRUPTIBLE);
     schedule();
 }
 
+/*
+ * Change the period and computation (budget for a server) of a registered task
+ * in place. The task keeps its timer and phase: the new parameters take effect
+ * from its next release on, a job already released finishes in the old mode.
+ * Like a declaration, the new computation must cover every declared critical
+ * section, and admission control checks the blocking terms of the new mode.
+ */
+int action_mode_change(pid_t pid, unsigned long period, unsigned long computation) {
+    RMS_task *task = __get_task(pid);
+    unsigned long demand, flags;
+    int rid;
+
+    if (task == NULL || computation > period) {
+        printk(KERN_ALERT "[Err] invalid mode change, pid: %d", pid);
+        return -EINVAL;
+    }
+    mutex_lock(&RMS_tasks_lock);
+    for (rid = 0; rid < MAX_RESOURCES; rid++) {
+        if (task->cs_ms[rid] > computation) {
+            mutex_unlock(&RMS_tasks_lock);
+            printk(KERN_ALERT "[Err] mode change of %d shorter than its critical section on %d", pid, rid);
+            return -EINVAL;
+        }
+    }
+    mutex_unlock(&RMS_tasks_lock);
+    demand = task_demand(task, computation);
+    if (admission_control(period, demand, task) == 0) {
+        printk(KERN_ALERT "mode change of %d failed to pass admission_control", pid);
+        return -EBUSY;
+    }
+
+    if (task->type == TASK_SERVER) {
+        // applied by the next replenishment
+        spin_lock_irqsave(&server_lock, flags);
+        task->new_period_ms = period;
+        task->new_compute_time_ms = computation;
+        task->mode_change = 1;
+        spin_unlock_irqrestore(&server_lock, flags);
+    } else {
+        // applied when the job released at mode_change_jiff yields
+        mutex_lock(&RMS_tasks_lock);
+        task->new_period_ms = period;
+        task->new_compute_time_ms = computation;
+        if (task->state == STATE_SLEEPING) {
+            task->mode_change_jiff = task->deadline_jiff;
+        } else {
+            task->mode_change_jiff = task->deadline_jiff + msecs_to_jiffies(task->period_ms);
+        }
+        task->mode_change = 1;
+        mutex_unlock(&RMS_tasks_lock);
+    }
+    printk(KERN_ALERT "mode change, pid: %d, period: %lu, computation: %lu", pid, period, computation);
+    return 0;
+}
+
+/*
+ * Declare that a task may hold a resource for up to cs ms per job. Ceilings
+ * and blocking terms come from these declarations, so the task set goes
+ * through admission control again, and a task holding the resource now
+ * runs at its new ceiling.
+ */
+int action_declare(pid_t pid, int rid, unsigned long cs) {
+    RMS_task *task = __get_task(pid);
+    unsigned long old;
+
+    if (task == NULL || rid < 0 || rid >= MAX_RESOURCES || cs > task->compute_time_ms ||
+        (task->mode_change && cs > task->new_compute_time_ms)) {
+        printk(KERN_ALERT "[Err] invalid resource declaration, pid: %d, resource: %d", pid, rid);
+        return -EINVAL;
+    }
+    mutex_lock(&RMS_tasks_lock);
+    old = task->cs_ms[rid];
+    task->cs_ms[rid] = cs;
+    mutex_unlock(&RMS_tasks_lock);
+
+    if (admission_control(task->period_ms, task_demand(task, task->compute_time_ms), task) == 0) {
+        mutex_lock(&RMS_tasks_lock);
+        task->cs_ms[rid] = old;
+        mutex_unlock(&RMS_tasks_lock);
+        printk(KERN_ALERT "resource %d of %d failed to pass admission_control", rid, pid);
+        return -EBUSY;
+    }
+    mutex_lock(&RMS_tasks_lock);
+    if (resources[rid].owner != NULL) {
+        __update_prio(resources[rid].owner);
+    }
+    mutex_unlock(&RMS_tasks_lock);
+    // the holder may preempt now
+    wake_up_process(dispatcher);
+    return 0;
+}
+
+/*
+ * Immediate priority ceiling: the locker runs at the ceiling of the resource
+ * (the shortest period of its users) until it unlocks. On one CPU the
+ * resource is then always free when requested. A locker can only find it
+ * taken when the holder runs outside RMS order, e.g. on another CPU or as a
+ * demoted server, and then sleeps until it is released.
+ */
+int action_lock(pid_t pid, int rid) {
+    RMS_task *task = __get_task(pid);
+    RMS_resource *res;
+    unsigned long ceiling, flags;
+
+    if (task == NULL || rid < 0 || rid >= MAX_RESOURCES || task->cs_ms[rid] == 0) {
+        printk(KERN_ALERT "[Err] lock of undeclared resource, pid: %d, resource: %d", pid, rid);
+        return -EINVAL;
+    }
+    res = &resources[rid];
+    while (1) {
+        mutex_lock(&RMS_tasks_lock);
+        if (res->owner == task) {
+            mutex_unlock(&RMS_tasks_lock);
+            return -EDEADLK;
+        }
+        if (res->owner == NULL) {
+            res->owner = task;
+            task->held |= 1UL << rid;
+            ceiling = __resource_ceiling(rid);
+            spin_lock_irqsave(&prio_lock, flags);
+            task->prio_period_ms = min(task->prio_period_ms, ceiling);
+            spin_unlock_irqrestore(&prio_lock, flags);
+            mutex_unlock(&RMS_tasks_lock);
+            break;
+        }
+        mutex_unlock(&RMS_tasks_lock);
+        if (wait_event_interruptible(res->wait, READ_ONCE(res->owner) == NULL)) {
+            return -EINTR;
+        }
+    }
+    trace_event(TRACE_LOCK, pid, rid);
+    return 0;
+}
+
+int action_unlock(pid_t pid, int rid) {
+    RMS_task *task = __get_task(pid);
+
+    if (task == NULL || rid < 0 || rid >= MAX_RESOURCES) {
+        return -EINVAL;
+    }
+    mutex_lock(&RMS_tasks_lock);
+    if (resources[rid].owner != task) {
+        mutex_unlock(&RMS_tasks_lock);
+        printk(KERN_ALERT "[Err] unlock of resource not held, pid: %d, resource: %d", pid, rid);
+        return -EPERM;
+    }
+    resources[rid].owner = NULL;
+    task->held &= ~(1UL << rid);
+    __update_prio(task);
+    mutex_unlock(&RMS_tasks_lock);
+
+    trace_event(TRACE_UNLOCK, pid, rid);
+    wake_up_interruptible(&resources[rid].wait);
+    // a ready task held off by the ceiling may preempt now
+    wake_up_process(dispatcher);
+    return 0;
+}
+
 void action_deregister(pid_t pid) {
     RMS_task *task;
 
@@ -253,48 +899,64 @@ void action_deregister(pid_t pid) {
     }
     mutex_unlock(&running_task_lock);
 
+    if (task == NULL) {
+        printk(KERN_ALERT "[Err] no such task to deregister, pid: %d", pid);
+        return;
+    }
     del_timer_sync(&task->wakeup_timer);
+    if (task->type == TASK_SERVER) {
+        del_timer_sync(&task->budget_timer);
+    }
+    mutex_lock(&RMS_tasks_lock);
+    __release_resources(task);
+    mutex_unlock(&RMS_tasks_lock);
+    unpin_task(task);
     __del_task(pid);
+    trace_event(TRACE_DEREGISTER, pid, 0);
     wake_up_process(dispatcher);
     printk(KERN_ALERT "[Deregistration] pid: %d", pid);
 }
 
-static ssize_t file_read (struct file *file, char __user *buffer, size_t count, loff_t *data) {
-    char buf[READ_BUFSIZE];
-    int len = 0;
+// One line per task, a seq_file so any number of tasks fits
+static int status_show(struct seq_file *m, void *v) {
     RMS_task *task;
-    struct list_head *ptr;
-
-    if (*data > 0 || count < READ_BUFSIZE) {
-        return 0;
-    }
 
     mutex_lock(&RMS_tasks_lock);
-    list_for_each(ptr, &tasks_list) {
-        task = list_entry(ptr, RMS_task, lis);
-        len += sprintf(buf+len, "%d,%lu,%lu,%d\n", task->pid,
-                        task->period_ms, task->compute_time_ms, task->state);
+    list_for_each_entry(task, &tasks_list, lis) {
+        seq_printf(m, "%d,%lu,%lu,%d,%d", task->pid,
+                   task->period_ms, task->compute_time_ms, task->state,
+                   task->pinned ? task_cpu(task->linux_task) : -1);
+        if (task->type == TASK_SERVER) {
+            seq_printf(m, ",server,%u,%d", jiffies_to_msecs(task->budget_jiff),
+                       task->pending_jobs);
+        }
+        seq_putc(m, '\n');
     }
     mutex_unlock(&RMS_tasks_lock);
+    return 0;
+}
 
-    if (copy_to_user(buffer, buf, len)) {
-       return -EFAULT;
-    }
-    *data += len;
-    return len;
+static int file_open(struct inode *inode, struct file *file) {
+    return single_open(file, status_show, NULL);
 }
 
 /*
  * Registration: "R,PID,PERIOD,COMPUTATION"
  * YIELD: "Y,PID"
  * DE-REGISTRATION: "D,PID"
+ * SERVER REGISTRATION: "S,PID,PERIOD,BUDGET"
+ * APERIODIC JOB: "A,PID"
+ * MODE CHANGE: "M,PID,PERIOD,COMPUTATION"
+ * RESOURCE DECLARATION: "C,PID,RESOURCE,CRITICAL SECTION"
+ * LOCK: "L,PID,RESOURCE"
+ * UNLOCK: "U,PID,RESOURCE"
  */
 static ssize_t file_write (struct file *file, const char __user *buffer, size_t count, loff_t *data) {
     char write_buffer[WRITE_BUFSIZE];
     int buffer_size = count;
     pid_t pid;
     unsigned long period, computation;
-    int n;
+    int n, rid, ret = 0;
     char action;
     if (count > WRITE_BUFSIZE) {
         buffer_size = WRITE_BUFSIZE;
@@ -303,38 +965,198 @@ static ssize_t file_write (struct file *file, const char __user *buffer, size_t
         return -EFAULT;
     }
     n = sscanf(write_buffer, "%c,%d,%lu,%lu", &action, &pid, &period, &computation);
+    if (action == 'C' || action == 'L' || action == 'U') {
+        n = sscanf(write_buffer, "%c,%d,%d,%lu", &action, &pid, &rid, &computation);
+    }
 
     if (action == 'Y' && n == 2) {
         action_yield(pid);
     } else if (action == 'R' && n == 4) {
-        action_register(pid, period, computation);
+        ret = action_register(pid, period, computation);
     } else if (action == 'D' && n == 2) {
         action_deregister(pid);
+    } else if (action == 'S' && n == 4) {
+        ret = action_register_server(pid, period, computation);
+    } else if (action == 'A' && n == 2) {
+        action_job(pid);
+    } else if (action == 'M' && n == 4) {
+        ret = action_mode_change(pid, period, computation);
+    } else if (action == 'C' && n == 4) {
+        ret = action_declare(pid, rid, computation);
+    } else if (action == 'L' && n == 3) {
+        ret = action_lock(pid, rid);
+    } else if (action == 'U' && n == 3) {
+        ret = action_unlock(pid, rid);
     } else {
         printk(KERN_ALERT "fail to interpret command: %s", write_buffer);
         return -EINVAL;
     }
+    if (ret) {
+        return ret;
+    }
     return buffer_size;
 }
 
 static const struct file_operations file = {
     .owner = THIS_MODULE,
-    .read  = file_read,
+    .open  = file_open,
+    .read  = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
     .write = file_write,
 };
 
+static int trace_open(struct inode *node, struct file *f) {
+    return 0;
+}
+
+static int trace_release(struct inode *node, struct file *f) {
+    return 0;
+}
+
+// Read-only mapping of the whole trace buffer
+static int trace_mmap(struct file *filp, struct vm_area_struct *vma) {
+    unsigned long index = 0;
+    unsigned long size = vma->vm_end - vma->vm_start;
+
+    if ((vma->vm_flags & VM_WRITE) || size > trace_bufsize) {
+        return -EINVAL;
+    }
+    // nor can mprotect make it writable later
+    vma->vm_flags &= ~VM_MAYWRITE;
+    while (index < size) {
+        if (remap_pfn_range(vma, vma->vm_start + index,
+                vmalloc_to_pfn(trace_buf + index), PAGE_SIZE, vma->vm_page_prot)) {
+            printk(KERN_ALERT "fail to mmap trace\n");
+            return -EAGAIN;
+        }
+        index += PAGE_SIZE;
+    }
+    return 0;
+}
+
+static const struct file_operations trace_fops = {
+    .open = trace_open,
+    .release = trace_release,
+    .mmap = trace_mmap,
+};
+
+void reserve_pages(void *mem_start, unsigned long len) {
+    unsigned long i;
+    for (i = 0; i < len; i += PAGE_SIZE) {
+        SetPageReserved(vmalloc_to_page(mem_start + i));
+    }
+}
+
+void un_reserve_pages(void *mem_start, unsigned long len) {
+    unsigned long i;
+    for (i = 0; i < len; i += PAGE_SIZE) {
+        ClearPageReserved(vmalloc_to_page(mem_start + i));
+    }
+}
+
+int trace_init(void) {
+    struct trace_header *hdr;
+    int ret;
+
+    trace_stride = PAGE_ALIGN(sizeof(struct trace_ring));
+    trace_bufsize = PAGE_SIZE + nr_cpu_ids * trace_stride;
+    trace_buf = vmalloc(trace_bufsize);
+    if (trace_buf == NULL) {
+        return -ENOMEM;
+    }
+    memset(trace_buf, 0, trace_bufsize);
+    reserve_pages(trace_buf, trace_bufsize);
+
+    hdr = trace_buf;
+    hdr->magic = TRACE_MAGIC;
+    hdr->version = TRACE_VERSION;
+    hdr->nr_cpus = nr_cpu_ids;
+    hdr->ring_size = TRACE_RING_SIZE;
+    hdr->ring_stride = trace_stride;
+
+    dev_major = register_chrdev(0, TRACE_DEVICE_NAME, &trace_fops);
+    if (dev_major < 0) {
+        ret = dev_major;
+        goto err_buf;
+    }
+    dev_class = class_create(THIS_MODULE, TRACE_CLASS_NAME);
+    if (IS_ERR(dev_class)) {
+        ret = PTR_ERR(dev_class);
+        goto err_chrdev;
+    }
+    trace_dev = device_create(dev_class, NULL, MKDEV(dev_major, 0), NULL, TRACE_DEVICE_NAME);
+    if (IS_ERR(trace_dev)) {
+        ret = PTR_ERR(trace_dev);
+        goto err_class;
+    }
+    return 0;
+
+err_class:
+    class_destroy(dev_class);
+err_chrdev:
+    unregister_chrdev(dev_major, TRACE_DEVICE_NAME);
+err_buf:
+    // tracing stays off, trace_event and trace_exit see no buffer
+    un_reserve_pages(trace_buf, trace_bufsize);
+    vfree(trace_buf);
+    trace_buf = NULL;
+    return ret;
+}
+
+void trace_exit(void) {
+    void *buf = trace_buf;
+    if (buf == NULL) {
+        return;
+    }
+    device_destroy(dev_class, MKDEV(dev_major, 0));
+    class_destroy(dev_class);
+    unregister_chrdev(dev_major, TRACE_DEVICE_NAME);
+
+    trace_buf = NULL;
+    un_reserve_pages(buf, trace_bufsize);
+    vfree(buf);
+}
+
 // mp2_init - Called when module is loaded
 int __init sche_init(void)
 {
+    int i;
+
     #ifdef DEBUG
     printk(KERN_ALERT "MP2 MODULE LOADING\n");
     #endif
     // Insert your code here ...
+    for (i = 0; i < MAX_RESOURCES; i++) {
+        init_waitqueue_head(&resources[i].wait);
+    }
+
+    if (parse_cpus("housekeeping_cpus", housekeeping_cpus, &housekeeping_mask) ||
+        parse_cpus("isolated_cpus", isolated_cpus, &isolated_mask)) {
+        return -EINVAL;
+    }
+    if (cpumask_intersects(&housekeeping_mask, &isolated_mask)) {
+        printk(KERN_ALERT "[WARN] housekeeping and isolated cpus overlap");
+    }
+
+    if (trace_init()) {
+        printk(KERN_ALERT "fail to set up the trace device, tracing is off\n");
+    }
+
+    dispatcher = kthread_create(dispatching, NULL, "dispatching");
+    if (IS_ERR(dispatcher)) {
+        trace_exit();
+        return PTR_ERR(dispatcher);
+    }
+    if (!cpumask_empty(&housekeeping_mask)) {
+        set_cpus_allowed_ptr(dispatcher, &housekeeping_mask);
+    }
+    wake_up_process(dispatcher);
+
+    // commands may come in from here on
     proc_dir = proc_mkdir(DIRECTORY, NULL);
     proc_entry = proc_create(FILENAME, 0666, proc_dir, &file);
 
-    dispatcher = kthread_run(dispatching, NULL, "dispatching");
-
     printk(KERN_ALERT "MP2 MODULE LOADED\n");
     return 0;
 }
@@ -349,7 +1171,9 @@ void __exit sche_exit(void)
     proc_remove(proc_entry);
     proc_remove(proc_dir);
 
+    kthread_stop(dispatcher);
     free_all_tasks();
+    trace_exit();
 
     printk(KERN_ALERT "MP2 MODULE UNLOADED\n");
 }
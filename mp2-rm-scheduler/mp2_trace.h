@@ -0,0 +1,57 @@
+#ifndef __MP2_TRACE_INCLUDE__
+#define __MP2_TRACE_INCLUDE__
+
+#include <linux/types.h>
+
+/*
+ * Layout of the buffer behind /dev/mp2_trace, shared with the trace tool.
+ *
+ * Page 0 holds a trace_header. It is followed by one ring per possible CPU,
+ * each ring_stride bytes apart. A ring is written only by its own CPU with
+ * interrupts off, so writers never contend. The writer bumps head after an
+ * event is complete, and an event slot holds its sequence number only while
+ * it is valid, so a reader can detect events overwritten under it.
+ */
+
+#define TRACE_DEVICE_NAME "mp2_trace"
+#define TRACE_MAGIC 0x6d703274  // "mp2t"
+#define TRACE_VERSION 1
+#define TRACE_RING_ORDER 12
+#define TRACE_RING_SIZE (1 << TRACE_RING_ORDER)  // events per CPU
+
+#define TRACE_REGISTER   1
+#define TRACE_RELEASE    2
+#define TRACE_DISPATCH   3
+#define TRACE_PREEMPT    4
+#define TRACE_YIELD      5
+#define TRACE_DEREGISTER 6
+#define TRACE_JOB        7  // aperiodic job queued to a server
+#define TRACE_EXHAUST    8  // server ran out of budget
+#define TRACE_MODE       9  // mode change applied
+#define TRACE_LOCK      10  // resource locked, arg is the resource id
+#define TRACE_UNLOCK    11
+
+struct trace_header {
+    __u32 magic;
+    __u32 version;
+    __u32 nr_cpus;
+    __u32 ring_size;
+    __u64 ring_stride;
+};
+
+struct trace_event {
+    __u64 seq;
+    __u64 ts_ns;   // ktime_get_ns(), comparable across CPUs
+    __s32 pid;
+    __u16 type;
+    __u16 cpu;
+    __u64 arg;     // period (ms) for REGISTER/RELEASE/MODE, 0 otherwise
+};
+
+struct trace_ring {
+    __u64 head;    // number of events ever written to this ring
+    __u64 pad[7];
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+#endif
@@ -1,4 +1,2 @@
-./userapp 45000000 2000 150 &
-./userapp 45000000 1000 150 &
-./userapp 45000000  900 150 &
-./userapp 45000000  800 150 &
\ No newline at end of file
+./userapp -o mp2.csv -r mp2-jobs.csv 2000:150 1000:150 900:150 800:150
+./userapp -n -o fifo.csv -r fifo-jobs.csv 2000:150 1000:150 900:150 800:150
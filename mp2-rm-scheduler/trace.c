@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include "mp2_trace.h"
+
+#define TRACE_FILE "/dev/" TRACE_DEVICE_NAME
+#define MAX_PID 4194304
+
+static const char *event_names[] = {
+    "?", "REGISTER", "RELEASE", "DISPATCH", "PREEMPT", "YIELD",
+    "DEREGISTER", "JOB", "EXHAUST", "MODE", "LOCK", "UNLOCK",
+};
+
+const char *event_name(int type) {
+    if (type <= 0 || type >= (int) (sizeof(event_names) / sizeof(event_names[0]))) {
+        return event_names[0];
+    }
+    return event_names[type];
+}
+
+int cmp_event(const void *a, const void *b) {
+    const struct trace_event *x = a, *y = b;
+    if (x->ts_ns != y->ts_ns) return x->ts_ns < y->ts_ns ? -1 : 1;
+    return x->cpu - y->cpu;
+}
+
+/*
+ * Copy the live events of one ring. An event is taken only if its slot still
+ * holds its own sequence number after the copy, i.e. it wasn't overwritten
+ * by the writer while we were reading it.
+ */
+int snapshot_ring(struct trace_ring *ring, __u32 size, struct trace_event *out,
+                  unsigned long *dropped) {
+    __u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    __u64 start = head > size ? head - size : 0;
+    __u64 seq;
+    int n = 0;
+
+    *dropped = start;
+    for (seq = start; seq < head; seq++) {
+        struct trace_event *ev = &ring->events[seq & (size - 1)];
+        out[n] = *ev;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (out[n].seq != seq || ev->seq != seq) {
+            (*dropped)++;
+            continue;
+        }
+        n++;
+    }
+    return n;
+}
+
+void usage(void) {
+    printf("Usage: ./trace [-c] [-p <pid>]\n");
+    printf("\t-c  print CSV instead of a timeline\n");
+    printf("\t-p  only show events of one pid\n");
+}
+
+int main(int argc, char* argv[]) {
+    struct trace_header *hdr;
+    struct trace_event *events;
+    unsigned long dropped, total_dropped = 0;
+    __u64 *last_release, t0;
+    size_t buf_len;
+    int csv = 0, only_pid = -1;
+    int fd, opt, n = 0, i;
+    void *buf;
+
+    while ((opt = getopt(argc, argv, "cp:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            csv = 1;
+            break;
+        case 'p':
+            only_pid = atoi(optarg);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    if ((fd = open(TRACE_FILE, O_RDONLY)) < 0) {
+        printf("fail to open file: %s\n", TRACE_FILE);
+        exit(1);
+    }
+    hdr = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED || hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION) {
+        printf("not an mp2 trace buffer: %s\n", TRACE_FILE);
+        exit(1);
+    }
+    buf_len = getpagesize() + hdr->nr_cpus * hdr->ring_stride;
+    buf = mmap(NULL, buf_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED) {
+        printf("fail to mmap trace buffer\n");
+        exit(1);
+    }
+
+    events = malloc(sizeof(struct trace_event) * hdr->nr_cpus * hdr->ring_size);
+    last_release = calloc(MAX_PID, sizeof(__u64));
+    for (i = 0; i < (int) hdr->nr_cpus; i++) {
+        struct trace_ring *ring = (struct trace_ring *) ((char *) buf + getpagesize() + i * hdr->ring_stride);
+        n += snapshot_ring(ring, hdr->ring_size, events + n, &dropped);
+        total_dropped += dropped;
+    }
+    qsort(events, n, sizeof(struct trace_event), cmp_event);
+
+    if (csv) {
+        printf("ts_ns,cpu,pid,event,arg,since_release_us\n");
+    } else if (total_dropped) {
+        printf("# %lu older events were overwritten\n", total_dropped);
+    }
+    t0 = n > 0 ? events[0].ts_ns : 0;
+    for (i = 0; i < n; i++) {
+        struct trace_event *ev = &events[i];
+        double since_release = -1;
+        if (ev->pid >= 0 && ev->pid < MAX_PID) {
+            if (ev->type == TRACE_RELEASE) {
+                last_release[ev->pid] = ev->ts_ns;
+            } else if (last_release[ev->pid]) {
+                since_release = (double) (ev->ts_ns - last_release[ev->pid]) / 1000;
+            }
+        }
+        if (only_pid >= 0 && ev->pid != only_pid) {
+            continue;
+        }
+        if (csv) {
+            printf("%llu,%u,%d,%s,%llu,%.3f\n", (unsigned long long) ev->ts_ns, ev->cpu,
+                   ev->pid, event_name(ev->type), (unsigned long long) ev->arg, since_release);
+        } else {
+            printf("%14.6f ms  cpu %3u  pid %7d  %-10s", (double) (ev->ts_ns - t0) / 1000000,
+                   ev->cpu, ev->pid, event_name(ev->type));
+            if (ev->type == TRACE_REGISTER || ev->type == TRACE_RELEASE || ev->type == TRACE_MODE) {
+                printf("  period %llu ms", (unsigned long long) ev->arg);
+            } else if (ev->type == TRACE_LOCK || ev->type == TRACE_UNLOCK) {
+                printf("  resource %llu", (unsigned long long) ev->arg);
+            } else if (since_release >= 0) {
+                printf("  +%.3f us after release", since_release);
+            }
+            printf("\n");
+        }
+    }
+
+    free(events);
+    free(last_release);
+    munmap(buf, buf_len);
+    munmap(hdr, getpagesize());
+    close(fd);
+    return 0;
+}
@@ -1,13 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <time.h>
+#include <sched.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
 
-#define PROC_FILE "/proc/mp2/status"
-#define true 1
-#define false 0
+#include "userapp.h"
 
-typedef unsigned int    uint;
+static unsigned long loops_per_ms;
+static int use_module = true;
+static int iter = DEFAULT_ITER;
 
 void write_to_file(char *s) {
     FILE *fp = fopen(PROC_FILE, "w");
@@ -31,104 +36,305 @@ int check_exist(uint pid) {
     }
 
     while (getline(&line, &len, fp) != -1) {
-        sscanf(line, "%d,", &pid_p);
+        sscanf(line, "%u,", &pid_p);
         if (pid_p == pid) {
             exist = true;
             break;
         }
     }
+    free(line);
     fclose(fp);
 
     return exist;
 }
 
-void sched_register(uint pid, uint period, uint computation) {
+void mp2_register(uint pid, uint period, uint computation) {
     char str[128];
-    sprintf(str, "R,%d,%d,%d", pid, period, computation);
+    sprintf(str, "R,%u,%u,%u", pid, period, computation);
     write_to_file(str);
-    printf("[Registered] pid: %d, period: %d, computation: %d\n", pid, period, computation);
 }
 
-void sched_yield(uint pid) {
+void mp2_yield(uint pid) {
     char str[32];
-    sprintf(str, "Y,%d", pid);
+    sprintf(str, "Y,%u", pid);
     write_to_file(str);
 }
 
-void sched_degister(uint pid) {
+void mp2_deregister(uint pid) {
     char s[64];
-    sprintf(s, "D,%d", pid);
+    sprintf(s, "D,%u", pid);
     write_to_file(s);
-    printf("[Deregistered] pid: %d\n", pid);
 }
 
-unsigned long factorial(uint n) {
-    unsigned long ans = 1;
-    for (int i = 1; i <= n; i++) {
-        ans *= i;
+nsec_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Fixed amount of work; volatile keeps the compiler from folding the loop
+void spin(unsigned long loops) {
+    volatile unsigned long i;
+    for (i = 0; i < loops; i++);
+}
+
+void compute(uint ms) {
+    spin(loops_per_ms * ms);
+}
+
+// Take the fastest of several runs, i.e. the one least disturbed by others,
+// so that compute(ms) costs ms of CPU time rather than ms of wall time
+void calibrate(void) {
+    unsigned long loops = 1000000;
+    nsec_t start, elapsed, best = 0;
+    int i;
+
+    // grow the probe until it runs long enough to time accurately
+    while (1) {
+        start = now_ns();
+        spin(loops);
+        if (now_ns() - start >= 10 * NSEC_PER_MSEC) break;
+        loops *= 2;
     }
-    return ans;
+    for (i = 0; i < 10; i++) {
+        start = now_ns();
+        spin(loops);
+        elapsed = now_ns() - start;
+        if (best == 0 || elapsed < best) best = elapsed;
+    }
+    loops_per_ms = loops * NSEC_PER_MSEC / best;
+
+    start = now_ns();
+    compute(100);
+    fprintf(stderr, "[Calibration] loops/ms: %lu, compute(100ms) took %.3f ms\n",
+            loops_per_ms, (double) (now_ns() - start) / NSEC_PER_MSEC);
 }
 
-unsigned long to_millisecond(struct timeval *t) {
-    return t->tv_sec * 1000 + (t->tv_usec / 1000);
+// Without the module, emulate RMS with SCHED_FIFO priorities and absolute sleeps
+void set_rm_priority(task_param *tasks, int ntask, int idx) {
+    struct sched_param sparam;
+    int i, rank = 0;
+    for (i = 0; i < ntask; i++) {
+        if (tasks[i].period > tasks[idx].period) rank++;
+    }
+    sparam.sched_priority = sched_get_priority_max(SCHED_FIFO) - ntask + rank + 1;
+    if (sched_setscheduler(0, SCHED_FIFO, &sparam) != 0) {
+        fprintf(stderr, "[WARN] fail to set SCHED_FIFO, running as SCHED_OTHER\n");
+    }
 }
 
-unsigned long get_time_interval(struct timeval *start, struct timeval *end) {
-    unsigned long start_ms = to_millisecond(start);
-    unsigned long end_ms = to_millisecond(end);
-    return end_ms - start_ms;
+void sleep_until(nsec_t t) {
+    struct timespec ts;
+    ts.tv_sec = t / NSEC_PER_SEC;
+    ts.tv_nsec = t % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
 }
 
-int main(int argc, char* argv[]) {
-    uint pid, n, period, computation;
-    struct timeval start, end, compute_time, loop_start, loop_end;
-    int iter = 10;
-    unsigned long total_time, average_time, actual_period, actual_compute_time;
-
-    pid = getpid();
-
-    if (argc == 1) {
-        n = 45000000;
-        period = 1000;
-        computation = 155;
-    } else if (argc == 4) {
-        n = atoi(argv[1]);
-        period = atoi(argv[2]);
-        computation = atoi(argv[3]);
+/*
+ * Body of one task process. Releases are anchored on the first wakeup after
+ * registration: release(i) = t0 + i * period. The module anchors its timer on
+ * jiffies at registration, so the constant offset is absorbed by t0.
+ */
+void run_task(task_param *tasks, int ntask, int idx, job_sample *samples) {
+    uint pid = getpid();
+    task_param *t = &tasks[idx];
+    nsec_t period_ns = t->period * NSEC_PER_MSEC;
+    nsec_t t0, release, wake, done;
+    int i;
+
+    if (use_module) {
+        mp2_register(pid, t->period, t->computation);
+        if (!check_exist(pid)) {
+            printf("pid %u failed admission control, exit...\n", pid);
+            exit(1);
+        }
+        mp2_yield(pid);
+        t0 = now_ns();
     } else {
-        printf("Invalid arguments\n");
-        printf("Usage: ./userapp <factorial n> <period> <computation>\n");
-        printf("\tExample: ./userapp 45000000 1000 155\n");
+        set_rm_priority(tasks, ntask, idx);
+        t0 = now_ns();
+    }
+
+    wake = t0;
+    for (i = 0; i < iter + WARMUP_JOBS; i++) {
+        release = t0 + i * period_ns;
+        compute(t->computation);
+        done = now_ns();
+        if (i >= WARMUP_JOBS) {
+            samples[i - WARMUP_JOBS].release_latency = wake - release;
+            samples[i - WARMUP_JOBS].response_time = done - release;
+            samples[i - WARMUP_JOBS].exec_time = done - wake;
+        }
+        if (use_module) {
+            mp2_yield(pid);
+        } else {
+            sleep_until(release + period_ns);
+        }
+        wake = now_ns();
+    }
+
+    if (use_module) {
+        mp2_deregister(pid);
+    }
+    exit(0);
+}
+
+int cmp_nsec(const void *a, const void *b) {
+    nsec_t x = *(const nsec_t *) a, y = *(const nsec_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+nsec_t percentile(nsec_t *v, int n, double p) {
+    int idx = (int) (p * n + 0.999999) - 1;
+    if (idx < 0) idx = 0;
+    if (idx >= n) idx = n - 1;
+    return v[idx];
+}
+
+void print_metric(FILE *out, const char *prefix, const char *metric, nsec_t *v, int n) {
+    double sum = 0;
+    int i;
+    qsort(v, n, sizeof(nsec_t), cmp_nsec);
+    for (i = 0; i < n; i++) sum += v[i];
+    fprintf(out, "%s,%s,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", prefix, metric,
+            (double) v[0] / NSEC_PER_USEC, sum / n / NSEC_PER_USEC,
+            (double) percentile(v, n, 0.50) / NSEC_PER_USEC,
+            (double) percentile(v, n, 0.90) / NSEC_PER_USEC,
+            (double) percentile(v, n, 0.99) / NSEC_PER_USEC,
+            (double) percentile(v, n, 0.999) / NSEC_PER_USEC,
+            (double) v[n - 1] / NSEC_PER_USEC);
+}
+
+void report(FILE *out, FILE *raw, task_param *tasks, int ntask, job_sample *samples) {
+    struct utsname uts;
+    char prefix[256];
+    const char *mode = use_module ? "mp2" : "fifo";
+    nsec_t *v = malloc(sizeof(nsec_t) * iter);
+    int i, j, misses;
+
+    uname(&uts);
+    fprintf(out, "kernel,mode,task,period_ms,computation_ms,jobs,misses,miss_ratio,"
+                 "metric,min_us,mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n");
+    if (raw) {
+        fprintf(raw, "kernel,mode,task,job,release_latency_ns,response_time_ns,exec_time_ns\n");
+    }
+    for (i = 0; i < ntask; i++) {
+        job_sample *s = &samples[i * iter];
+        nsec_t period_ns = tasks[i].period * NSEC_PER_MSEC;
+
+        misses = 0;
+        for (j = 0; j < iter; j++) {
+            if (s[j].response_time > period_ns) misses++;
+            if (raw) {
+                fprintf(raw, "%s,%s,%d,%d,%lld,%lld,%lld\n", uts.release, mode, i, j,
+                        s[j].release_latency, s[j].response_time, s[j].exec_time);
+            }
+        }
+        snprintf(prefix, sizeof(prefix), "%s,%s,%d,%u,%u,%d,%d,%.4f", uts.release, mode, i,
+                 tasks[i].period, tasks[i].computation, iter, misses, (double) misses / iter);
+
+        for (j = 0; j < iter; j++) v[j] = s[j].release_latency;
+        print_metric(out, prefix, "release_latency", v, iter);
+        for (j = 0; j < iter; j++) v[j] = s[j].response_time;
+        print_metric(out, prefix, "response_time", v, iter);
+        // jitter: change of release latency between consecutive jobs
+        if (iter > 1) {
+            for (j = 1; j < iter; j++) {
+                v[j - 1] = s[j].release_latency - s[j - 1].release_latency;
+                if (v[j - 1] < 0) v[j - 1] = -v[j - 1];
+            }
+            print_metric(out, prefix, "jitter", v, iter - 1);
+        }
+    }
+    free(v);
+}
+
+void usage(void) {
+    printf("Usage: ./userapp [-n] [-i <iterations>] [-o <summary.csv>] [-r <jobs.csv>] "
+           "<period>:<computation> [<period>:<computation> ...]\n");
+    printf("\t-n  run without the MP2 module (SCHED_FIFO + clock_nanosleep baseline)\n");
+    printf("\tExample: ./userapp -i 200 -o mp2.csv 1000:150 800:150\n");
+}
+
+int main(int argc, char* argv[]) {
+    task_param tasks[MAX_TASKS];
+    job_sample *samples;
+    FILE *out = stdout, *raw = NULL;
+    int ntask = 0, opt, i, status, failed = 0;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "ni:o:r:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            use_module = false;
+            break;
+        case 'i':
+            iter = atoi(optarg);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (out == NULL) {
+                printf("fail to open file: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            raw = fopen(optarg, "w");
+            if (raw == NULL) {
+                printf("fail to open file: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    for (i = optind; i < argc; i++) {
+        if (ntask == MAX_TASKS ||
+            sscanf(argv[i], "%u:%u", &tasks[ntask].period, &tasks[ntask].computation) != 2 ||
+            tasks[ntask].period == 0 || tasks[ntask].computation > tasks[ntask].period) {
+            printf("Invalid task: %s\n", argv[i]);
+            usage();
+            exit(1);
+        }
+        ntask++;
+    }
+    if (ntask == 0 || iter < 1) {
+        usage();
         exit(1);
     }
 
-    sched_register(pid, period, computation);
-    if (!check_exist(pid)) {
-        printf("pid doesn't exist, exit...\n");
+    samples = mmap(NULL, sizeof(job_sample) * ntask * iter, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED) {
+        printf("fail to allocate sample buffer\n");
         exit(1);
     }
 
-    sched_yield(pid);
+    calibrate();
 
-    gettimeofday(&loop_start, NULL);
-    for (int i = 0; i < iter; i++) {
-        gettimeofday(&start, NULL);
-        factorial(n);
-        gettimeofday(&compute_time, NULL);
-        sched_yield(pid);
-        gettimeofday(&end, NULL);
-        actual_period = get_time_interval(&start, &end);
-        actual_compute_time = get_time_interval(&start, &compute_time);
-        printf("Pid: %6d, actual period: %6lu, expect period: %6d, actual compute: %6lu, expect compute: %6d\n",
-               pid, actual_period, period, actual_compute_time, computation);
+    for (i = 0; i < ntask; i++) {
+        pid = fork();
+        if (pid == 0) {
+            run_task(tasks, ntask, i, &samples[i * iter]);
+        } else if (pid < 0) {
+            printf("fail to fork task %d\n", i);
+            exit(1);
+        }
+    }
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    if (failed) {
+        printf("%d task(s) failed\n", failed);
+        exit(1);
     }
-    gettimeofday(&loop_end, NULL);
-    total_time = to_millisecond(&loop_end) - to_millisecond(&loop_start);
-    average_time = total_time / iter;
-    printf("average period: %lu, total time: %lu, iter: %d\n", average_time, total_time, iter);
 
-    sched_degister(pid);
+    report(out, raw, tasks, ntask, samples);
 
+    if (out != stdout) fclose(out);
+    if (raw) fclose(raw);
     return 0;
 }
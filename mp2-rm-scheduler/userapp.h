@@ -0,0 +1,34 @@
+#ifndef __USERAPP_INCLUDE__
+#define __USERAPP_INCLUDE__
+
+#include <sys/types.h>
+
+#define PROC_FILE "/proc/mp2/status"
+#define true 1
+#define false 0
+
+#define MAX_TASKS 16
+#define DEFAULT_ITER 100
+#define WARMUP_JOBS 1
+
+#define NSEC_PER_USEC 1000LL
+#define NSEC_PER_MSEC 1000000LL
+#define NSEC_PER_SEC  1000000000LL
+
+typedef unsigned int    uint;
+typedef long long       nsec_t;
+
+// One periodic task of the task set, given as <period>:<computation> in ms
+typedef struct task_param {
+    uint period;
+    uint computation;
+} task_param;
+
+// Timestamps of one job, all relative to the expected release of the job
+typedef struct job_sample {
+    nsec_t release_latency;  // wakeup - expected release
+    nsec_t response_time;    // completion - expected release
+    nsec_t exec_time;        // completion - wakeup
+} job_sample;
+
+#endif
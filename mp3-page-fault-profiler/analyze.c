@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mp3_buf.h"
+#include "mp3_decode.h"
+
+#define LIVE_INPUT "/dev/node"
+
+// Samples of one input, one array per field. Per pid records of the same tick are summed, thread records are already in their group's.
+struct series {
+  long n, cap;
+  __u64 *t, *min_flt, *maj_flt, *cpu, *wss;
+};
+
+struct summary {
+  int ok;
+  __u32 mode;
+  __u64 sequence, lost;
+  long samples;
+  double duration_s, minor, major, util, wss_mean, wss_max;
+  double rate_mean, rate_p50, rate_p90, rate_p99, rate_max, major_rate_p99;  // faults/s
+};
+
+static char **inputs;
+static struct summary *summaries;
+static int ninput;
+static int next_input = 0;
+static char *series_prefix = NULL;
+
+void add_sample(void *arg, const struct mp3_sample *s)
+{
+  struct series *se = arg;
+  long i = se->n;
+
+  if(s->tgid > 0)
+    return;
+  if(i > 0 && se->t[i - 1] == s->timestamp){
+    i--;
+    se->min_flt[i] += s->min_flt;
+    se->maj_flt[i] += s->maj_flt;
+    se->cpu[i] += s->cpu_time;
+    se->wss[i] += s->wss;
+    return;
+  }
+  if(i == se->cap){
+    se->cap = se->cap ? se->cap * 2 : 4096;
+    se->t = realloc(se->t, se->cap * sizeof(__u64));
+    se->min_flt = realloc(se->min_flt, se->cap * sizeof(__u64));
+    se->maj_flt = realloc(se->maj_flt, se->cap * sizeof(__u64));
+    se->cpu = realloc(se->cpu, se->cap * sizeof(__u64));
+    se->wss = realloc(se->wss, se->cap * sizeof(__u64));
+    if(!se->t || !se->min_flt || !se->maj_flt || !se->cpu || !se->wss){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  se->t[i] = s->timestamp;
+  se->min_flt[i] = s->min_flt;
+  se->maj_flt[i] = s->maj_flt;
+  se->cpu[i] = s->cpu_time;
+  se->wss[i] = s->wss;
+  se->n++;
+}
+
+// This function decodes the unread records of the live buffer without consuming them. It returns 0 on success.
+int load_live(struct series *se, struct summary *sum)
+{
+  struct mp3_buf_header *hdr;
+  struct mp3_decoder d;
+  size_t page = getpagesize(), len;
+  __u64 producer, consumer;
+  int fd;
+
+  if((fd = open(LIVE_INPUT, O_RDONLY)) < 0){
+    fprintf(stderr, "file open error. %s\n", LIVE_INPUT);
+    return -1;
+  }
+  hdr = mmap(0, page, PROT_READ, MAP_SHARED, fd, 0);
+  if(hdr == MAP_FAILED || hdr->magic != MP3_BUF_MAGIC || hdr->version != MP3_BUF_VERSION){
+    fprintf(stderr, "unknown buffer layout, rebuild analyze against this module\n");
+    close(fd);
+    return -1;
+  }
+  len = (hdr->heat_offset + page - 1) / page * page;
+  munmap(hdr, page);
+  hdr = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(hdr == MAP_FAILED){
+    fprintf(stderr, "buf file open error.\n");
+    return -1;
+  }
+
+  memset(&d, 0, sizeof(d));
+  producer = __atomic_load_n(&hdr->producer, __ATOMIC_ACQUIRE);
+  consumer = __atomic_load_n(&hdr->consumer, __ATOMIC_RELAXED);
+  if(mp3_decode(&d, (unsigned char *) hdr + hdr->data_offset, hdr->data_size,
+                consumer % hdr->data_size, producer - consumer, hdr->mode, hdr->record_size,
+                add_sample, se) < 0){
+    fprintf(stderr, "corrupt data in the live buffer\n");
+    munmap(hdr, len);
+    return -1;
+  }
+  sum->mode = hdr->mode;
+  sum->sequence = hdr->sequence;
+  sum->lost = hdr->lost;
+  munmap(hdr, len);
+  return 0;
+}
+
+// This function decodes a capture file written by record. It returns 0 on success.
+int load_capture(char *fname, struct series *se, struct summary *sum)
+{
+  struct mp3_capture_header *cap;
+  struct mp3_decoder d;
+  struct stat st;
+  __u64 len;
+  int fd;
+
+  if((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+    fprintf(stderr, "file open error. %s\n", fname);
+    return -1;
+  }
+  cap = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(cap == MAP_FAILED || (__u64) st.st_size < sizeof(*cap) || cap->data_offset > (__u64) st.st_size ||
+     cap->magic != MP3_CAPTURE_MAGIC || cap->version != MP3_BUF_VERSION){
+    fprintf(stderr, "not a capture of this version: %s\n", fname);
+    return -1;
+  }
+  // one sequential pass over the mapping
+  madvise(cap, st.st_size, MADV_SEQUENTIAL);
+  memset(&d, 0, sizeof(d));
+  len = st.st_size - cap->data_offset;
+  if(mp3_decode(&d, (unsigned char *) cap + cap->data_offset, len, 0, len, cap->mode,
+                cap->record_size, add_sample, se) < 0){
+    fprintf(stderr, "corrupt data: %s\n", fname);
+    munmap(cap, st.st_size);
+    return -1;
+  }
+  sum->mode = cap->mode;
+  sum->sequence = cap->sequence;
+  sum->lost = cap->lost;
+  munmap(cap, st.st_size);
+  return 0;
+}
+
+// The fault rate over one sampling interval and the interval's length in s
+struct interval {
+  double rate;
+  double dt;
+};
+
+int cmp_interval(const void *a, const void *b)
+{
+  double x = ((const struct interval *) a)->rate, y = ((const struct interval *) b)->rate;
+  return (x > y) - (x < y);
+}
+
+// Time-weighted percentile of intervals sorted by rate: the rate in effect at fraction p of the total time
+double percentile(struct interval *v, long n, double total, double p)
+{
+  double seen = 0;
+  long i;
+
+  for(i = 0; i < n - 1; i++){
+    seen += v[i].dt;
+    if(seen >= p * total)
+      break;
+  }
+  return v[i].rate;
+}
+
+// The series of one input as CSV: cumulative counters and the rates of each interval
+void write_series(struct series *se, int index)
+{
+  char fname[4096];
+  FILE *fp;
+  __u64 cum_min = 0, cum_maj = 0, cum_cpu = 0;
+  double dt;
+  long i;
+
+  snprintf(fname, sizeof(fname), "%s%d.csv", series_prefix, index);
+  if((fp = fopen(fname, "w")) == NULL){
+    fprintf(stderr, "file open error. %s\n", fname);
+    return;
+  }
+  fprintf(fp, "time_ms,cum_minor,cum_major,cum_cpu_ms,fault_rate,cpu_util,wss_pages\n");
+  for(i = 0; i < se->n; i++){
+    cum_min += se->min_flt[i];
+    cum_maj += se->maj_flt[i];
+    cum_cpu += se->cpu[i];
+    dt = i > 0 ? (se->t[i] - se->t[i - 1]) / 1e9 : 0;
+    fprintf(fp, "%.3f,%llu,%llu,%.3f,%.1f,%.4f,%llu\n", (se->t[i] - se->t[0]) / 1e6,
+            (unsigned long long) cum_min, (unsigned long long) cum_maj, cum_cpu / 1e3,
+            dt > 0 ? (se->min_flt[i] + se->maj_flt[i]) / dt : 0,
+            dt > 0 ? se->cpu[i] / 1e6 / dt : 0, (unsigned long long) se->wss[i]);
+  }
+  fclose(fp);
+}
+
+/*
+ * All sums and per interval rates in one pass over the arrays, then the
+ * percentiles. The first sample only opens the first interval. Intervals
+ * are weighted by their length, so with the adaptive period a burst of
+ * short intervals counts for the time it lasted, not for its sample count.
+ */
+void summarize(struct series *se, struct summary *sum)
+{
+  struct interval *rate, *maj_rate;
+  double dt, total = 0, faults = 0, wss_sum = 0, wss_max = 0;
+  double minor = 0, major = 0, cpu = 0;
+  long i, m = se->n > 1 ? se->n - 1 : 0;
+
+  sum->samples = se->n;
+  if(se->n == 0)
+    return;
+  rate = malloc(sizeof(struct interval) * (m + 1));
+  maj_rate = malloc(sizeof(struct interval) * (m + 1));
+  if(!rate || !maj_rate){
+    free(rate);
+    free(maj_rate);
+    m = 0;
+  }
+  for(i = 0; i < se->n; i++){
+    minor += se->min_flt[i];
+    major += se->maj_flt[i];
+    cpu += se->cpu[i];
+    wss_sum += se->wss[i];
+    if(se->wss[i] > wss_max)
+      wss_max = se->wss[i];
+    if(i > 0 && m > 0){
+      dt = (se->t[i] - se->t[i - 1]) / 1e9;
+      rate[i - 1].rate = dt > 0 ? (se->min_flt[i] + se->maj_flt[i]) / dt : 0;
+      maj_rate[i - 1].rate = dt > 0 ? se->maj_flt[i] / dt : 0;
+      rate[i - 1].dt = maj_rate[i - 1].dt = dt;
+      total += dt;
+      faults += se->min_flt[i] + se->maj_flt[i];
+    }
+  }
+  sum->duration_s = (se->t[se->n - 1] - se->t[0]) / 1e9;
+  sum->minor = minor;
+  sum->major = major;
+  sum->util = sum->duration_s > 0 ? cpu / 1e6 / sum->duration_s : 0;
+  sum->wss_mean = wss_sum / se->n;
+  sum->wss_max = wss_max;
+  if(m > 0){
+    qsort(rate, m, sizeof(struct interval), cmp_interval);
+    qsort(maj_rate, m, sizeof(struct interval), cmp_interval);
+    sum->rate_mean = total > 0 ? faults / total : 0;
+    sum->rate_p50 = percentile(rate, m, total, 0.50);
+    sum->rate_p90 = percentile(rate, m, total, 0.90);
+    sum->rate_p99 = percentile(rate, m, total, 0.99);
+    sum->rate_max = rate[m - 1].rate;
+    sum->major_rate_p99 = percentile(maj_rate, m, total, 0.99);
+    free(rate);
+    free(maj_rate);
+  }
+}
+
+// Inputs are handed out one at a time, so a long capture doesn't hold up the short ones
+void *worker(void *arg)
+{
+  struct series se;
+  int i, r;
+
+  (void) arg;
+
+  while((i = __atomic_fetch_add(&next_input, 1, __ATOMIC_RELAXED)) < ninput){
+    memset(&se, 0, sizeof(se));
+    if(strcmp(inputs[i], LIVE_INPUT) == 0)
+      r = load_live(&se, &summaries[i]);
+    else
+      r = load_capture(inputs[i], &se, &summaries[i]);
+    if(r == 0){
+      summarize(&se, &summaries[i]);
+      if(series_prefix)
+        write_series(&se, i);
+      summaries[i].ok = 1;
+    }
+    free(se.t);
+    free(se.min_flt);
+    free(se.maj_flt);
+    free(se.cpu);
+    free(se.wss);
+  }
+  return NULL;
+}
+
+void print_csv(void)
+{
+  struct summary *s;
+  int i;
+
+  printf("file,mode,samples,lost,duration_s,minor_faults,major_faults,cpu_util,wss_mean_pages,"
+         "wss_max_pages,fault_rate_mean,fault_rate_p50,fault_rate_p90,fault_rate_p99,"
+         "fault_rate_max,major_rate_p99\n");
+  for(i = 0; i < ninput; i++){
+    s = &summaries[i];
+    if(!s->ok)
+      continue;
+    printf("%s,%u,%ld,%llu,%.3f,%.0f,%.0f,%.4f,%.1f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+           inputs[i], s->mode, s->samples, (unsigned long long) s->lost, s->duration_s,
+           s->minor, s->major, s->util, s->wss_mean, s->wss_max, s->rate_mean, s->rate_p50,
+           s->rate_p90, s->rate_p99, s->rate_max, s->major_rate_p99);
+  }
+}
+
+void print_json(void)
+{
+  struct summary *s;
+  int i, first = 1;
+
+  printf("[");
+  for(i = 0; i < ninput; i++){
+    s = &summaries[i];
+    if(!s->ok)
+      continue;
+    printf("%s\n  {\"file\": \"%s\", \"mode\": %u, \"samples\": %ld, \"lost\": %llu, "
+           "\"duration_s\": %.3f, \"minor_faults\": %.0f, \"major_faults\": %.0f, "
+           "\"cpu_util\": %.4f, \"wss_mean_pages\": %.1f, \"wss_max_pages\": %.0f, "
+           "\"fault_rate\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+           "\"max\": %.1f}, \"major_rate_p99\": %.1f}",
+           first ? "" : ",", inputs[i], s->mode, s->samples, (unsigned long long) s->lost,
+           s->duration_s, s->minor, s->major, s->util, s->wss_mean, s->wss_max, s->rate_mean,
+           s->rate_p50, s->rate_p90, s->rate_p99, s->rate_max, s->major_rate_p99);
+    first = 0;
+  }
+  printf("\n]\n");
+}
+
+void usage(void)
+{
+  printf("Usage: ./analyze [-j] [-t <threads>] [-s <series prefix>] <capture file | %s> ...\n", LIVE_INPUT);
+  printf("\tOne summary row per input, as CSV or with -j as JSON. %s reads the unread\n", LIVE_INPUT);
+  printf("\tsamples of the live buffer without consuming them. -s also writes the per\n");
+  printf("\tsample series of input i to <series prefix>i.csv\n");
+}
+
+int main(int argc, char* argv[])
+{
+  pthread_t *threads;
+  int opt, i, nthread = sysconf(_SC_NPROCESSORS_ONLN), json = 0;
+
+  while((opt = getopt(argc, argv, "jt:s:h")) != -1){
+    switch(opt){
+    case 'j':
+      json = 1;
+      break;
+    case 't':
+      nthread = atoi(optarg);
+      break;
+    case 's':
+      series_prefix = optarg;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  ninput = argc - optind;
+  if(ninput < 1 || nthread < 1){
+    usage();
+    return 1;
+  }
+  inputs = argv + optind;
+  summaries = calloc(ninput, sizeof(struct summary));
+  if(nthread > ninput)
+    nthread = ninput;
+  threads = malloc(sizeof(pthread_t) * nthread);
+
+  for(i = 0; i < nthread; i++)
+    pthread_create(&threads[i], NULL, worker, NULL);
+  for(i = 0; i < nthread; i++)
+    pthread_join(threads[i], NULL);
+
+  if(json)
+    print_json();
+  else
+    print_csv();
+  free(threads);
+  free(summaries);
+  return 0;
+}
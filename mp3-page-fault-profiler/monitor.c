@@ -1,91 +1,264 @@
 #include <stdio.h>
-#include <sys/syscall.h>
-#include <unistd.h>
-#include <stdio.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define NPAGES (128)   // The size of profiler buffer (Unit: memory page)
-#define BUFD_MAX 48000 // The max number of profiled samples stored in the profiler buffer
+#include "mp3_buf.h"
+#include "mp3_decode.h"
 
 static int buf_fd = -1;
-static int buf_len;
+static size_t buf_len;
+static volatile sig_atomic_t stop = 0;
 
-// This function opens a character device (which is pointed by a file named as fname) and performs the mmap() operation. If the operations are successful, the base address of memory mapped buffer is returned. Otherwise, a NULL pointer is returned.
-void *buf_init(char *fname)
+// This function opens a character device (which is pointed by a file named as fname) and performs the mmap() operation. The header page tells how much to map. If the operations are successful, the header of the memory mapped buffer is returned. Otherwise, a NULL pointer is returned.
+struct mp3_buf_header *buf_init(char *fname)
 {
-  unsigned int *kadr;
+  struct mp3_buf_header *hdr;
+  size_t page = getpagesize();
 
   if(buf_fd == -1){
-    buf_len = NPAGES * getpagesize();
     if ((buf_fd=open(fname, O_RDWR|O_SYNC))<0){
         printf("file open error. %s\n", fname);
         return NULL;
     }
   }
-  kadr = mmap(0, buf_len, PROT_READ|PROT_WRITE, MAP_SHARED, buf_fd, 0);
-  if (kadr == MAP_FAILED){
+  hdr = mmap(0, page, PROT_READ, MAP_SHARED, buf_fd, 0);
+  if (hdr == MAP_FAILED){
       printf("buf file open error.\n");
       return NULL;
   }
+  if (hdr->magic != MP3_BUF_MAGIC || hdr->version != MP3_BUF_VERSION){
+      printf("unknown buffer layout, rebuild monitor against this module\n");
+      munmap(hdr, page);
+      return NULL;
+  }
+  buf_len = (hdr->heat_offset + hdr->heat_size + page - 1) / page * page;
+  munmap(hdr, page);
 
-  return kadr;
+  hdr = mmap(0, buf_len, PROT_READ|PROT_WRITE, MAP_SHARED, buf_fd, 0);
+  if (hdr == MAP_FAILED){
+      printf("buf file open error.\n");
+      return NULL;
+  }
+  return hdr;
 }
 
 // This function closes the opened character device file.
-void buf_exit()
+void buf_exit(struct mp3_buf_header *hdr)
 {
+  if(hdr)
+    munmap(hdr, buf_len);
   if(buf_fd != -1){
     close(buf_fd);
     buf_fd = -1;
   }
 }
 
+static struct mp3_decoder decoder;
+
+// Timestamps are printed in ns and cpu time in us
+void print_sample(void *arg, const struct mp3_sample *s)
+{
+  (void) arg;
+  if(s->pid >= 0)
+    printf("%llu %lld %llu %llu %llu %llu %lld\n", (unsigned long long) s->timestamp, (long long) s->pid,
+           (unsigned long long) s->min_flt, (unsigned long long) s->maj_flt,
+           (unsigned long long) s->cpu_time, (unsigned long long) s->wss, (long long) s->tgid);
+  else
+    printf("%llu %llu %llu %llu %llu\n", (unsigned long long) s->timestamp,
+           (unsigned long long) s->min_flt, (unsigned long long) s->maj_flt,
+           (unsigned long long) s->cpu_time, (unsigned long long) s->wss);
+}
+
+// This function prints the len bytes of records starting at offset off of a ring of size bytes. It returns the number of records read, or -1 for corrupt data.
+long decode(unsigned char *data, __u64 size, __u64 off, __u64 len, __u32 mode, __u32 record_size)
+{
+  struct mp3_fault_record *f;
+  struct mp3_cpu_record *c;
+  long i = 0;
+
+  if(mode != MODE_FAULTS && mode != MODE_CPUS)
+    return mp3_decode(&decoder, data, size, off, len, mode, record_size, print_sample, NULL);
+  if(mp3_check_layout(mode, record_size) < 0)
+    return -1;
+  for(; len >= record_size; len -= record_size, i++){
+    if(off + record_size > size)
+      return -1;
+    f = (struct mp3_fault_record *) (data + off);
+    c = (struct mp3_cpu_record *) (data + off);
+    if(mode == MODE_CPUS)
+      printf("%llu %u %u %u %u %u %u\n", (unsigned long long) c->timestamp, c->cpu, c->node,
+             c->min_flt, c->maj_flt, c->remote_flt, c->cpu_time);
+    else
+      printf("%llu %d 0x%llx %s\n", (unsigned long long) f->timestamp, f->pid,
+             (unsigned long long) f->address, f->flags & FAULT_MAJOR ? "major" : "minor");
+    off += record_size;
+    if(off == size)
+      off = 0;
+  }
+  return i;
+}
+
+// This function prints every unread record and hands the space back to the module. It returns the number of records read, or -1 for corrupt data.
+long drain(struct mp3_buf_header *hdr)
+{
+  __u64 producer = __atomic_load_n(&hdr->producer, __ATOMIC_ACQUIRE);
+  __u64 consumer = hdr->consumer;
+  long i;
+
+  i = decode((unsigned char *) hdr + hdr->data_offset, hdr->data_size,
+             consumer % hdr->data_size, producer - consumer, hdr->mode, hdr->record_size);
+  __atomic_store_n(&hdr->consumer, producer, __ATOMIC_RELEASE);
+  if(i < 0)
+    fprintf(stderr, "corrupt data\n");
+  return i;
+}
+
+// This function prints a capture file written by record. It returns the number of records read, or -1.
+long read_capture(char *fname)
+{
+  struct mp3_capture_header *cap;
+  struct stat st;
+  __u64 len;
+  long i;
+  int fd;
+
+  if((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+    printf("file open error. %s\n", fname);
+    return -1;
+  }
+  cap = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(cap == MAP_FAILED || (__u64) st.st_size < sizeof(*cap) || cap->data_offset > (__u64) st.st_size ||
+     cap->magic != MP3_CAPTURE_MAGIC || cap->version != MP3_BUF_VERSION){
+    printf("not a capture of this version: %s\n", fname);
+    return -1;
+  }
+  // trust the file size over data_size, which is only filled in when record exits cleanly
+  len = st.st_size - cap->data_offset;
+  i = decode((unsigned char *) cap + cap->data_offset, len, 0, len, cap->mode, cap->record_size);
+  if(i < 0){
+    fprintf(stderr, "corrupt data: %s\n", fname);
+    munmap(cap, st.st_size);
+    return -1;
+  }
+  fprintf(stderr, "read %ld profiled data, %llu of %llu samples lost, period %u ms\n", i,
+          (unsigned long long) cap->lost, (unsigned long long) cap->sequence, cap->period_ms);
+  munmap(cap, st.st_size);
+  return i;
+}
+
+// This function prints the fault heat table, one line per VMA followed by the minor and major faults of each bucket.
+void print_heat(struct mp3_buf_header *hdr)
+{
+  struct mp3_heat *heat = (struct mp3_heat *) ((char *) hdr + hdr->heat_offset);
+  struct mp3_vma_heat *v;
+  __u32 i, b, n = __atomic_load_n(&heat->nr_vmas, __ATOMIC_ACQUIRE);
+
+  printf("# rate 1/%u, %llu faults seen, %llu sampled, %llu without a slot\n", heat->rate,
+         (unsigned long long) heat->seen, (unsigned long long) heat->sampled,
+         (unsigned long long) heat->no_slot);
+  for(i = 0; i < n; i++){
+    v = &heat->vmas[i];
+    printf("%d 0x%llx-0x%llx %u %u\n", v->pid, (unsigned long long) v->start,
+           (unsigned long long) v->end, v->minor, v->major);
+    for(b = 0; b < HEAT_BUCKETS; b++)
+      printf("%u%c", v->bucket_minor[b], b == HEAT_BUCKETS - 1 ? '\n' : ' ');
+    for(b = 0; b < HEAT_BUCKETS; b++)
+      printf("%u%c", v->bucket_major[b], b == HEAT_BUCKETS - 1 ? '\n' : ' ');
+  }
+}
+
+// This function opens a character device and registers the pids in a private session of the open file, sampled only into its own buffer until the file is closed. It returns 0 on success.
+int session_init(char *fname, int npid, char **pids)
+{
+  char cmd[32];
+  int i, len;
+
+  if ((buf_fd=open(fname, O_RDWR|O_SYNC))<0){
+      printf("file open error. %s\n", fname);
+      return -1;
+  }
+  for(i = 0; i < npid; i++){
+    len = snprintf(cmd, sizeof(cmd), "R %d", atoi(pids[i]));
+    if(write(buf_fd, cmd, len) != len){
+      printf("fail to register %s\n", pids[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void on_signal(int sig)
+{
+  (void) sig;
+  stop = 1;
+}
+
 int main(int argc, char* argv[])
 {
-  long *buf;
-  int index = 0;
-  int i;
+  struct mp3_buf_header *hdr;
+  struct pollfd pfd;
+  int follow = argc > 1 && strcmp(argv[1], "-f") == 0;
+  long i, n;
+
+  // Print a capture file instead of the live buffer
+  if(argc > 2 && strcmp(argv[1], "-r") == 0)
+    return read_capture(argv[2]) < 0 ? -1 : 0;
+
+  // With -p, profile the given pids on their own, for as long as monitor runs
+  if(argc > 2 && strcmp(argv[1], "-p") == 0){
+    if(session_init("/dev/node", argc - 2, argv + 2) < 0)
+      return -1;
+    follow = 1;
+  }
 
   // Open the char device and mmap()
-  buf = buf_init("/dev/node");
-  if(!buf)
+  hdr = buf_init("/dev/node");
+  if(!hdr)
+    return -1;
+
+  // Print the fault heat table instead of the records
+  if(argc > 1 && strcmp(argv[1], "-m") == 0){
+    print_heat(hdr);
+    buf_exit(hdr);
+    return 0;
+  }
+
+  // Read and print profiled data, with -f keep waiting for more until interrupted
+  i = drain(hdr);
+  if(i < 0){
+    buf_exit(hdr);
     return -1;
-  
-  // Read and print profiled data
-  for(index=0; index<BUFD_MAX; index++)
-    if(buf[index] != -1) break;
-
-  i = 0;
-  while(buf[index] != -1){
-    printf("%ld ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%ld ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%ld ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%ld\n", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-    i++;
-  }
-  printf("read %d profiled data\n", i);
+  }
+  if(follow){
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    pfd.fd = buf_fd;
+    pfd.events = POLLIN;
+    while(!stop){
+      if(poll(&pfd, 1, -1) > 0){
+        if((n = drain(hdr)) < 0)
+          break;
+        i += n;
+      }
+      fflush(stdout);
+    }
+  }
+  // Keep stdout plain data for plot.py
+  fprintf(stderr, "read %ld profiled data, %llu of %llu samples lost, %llu periods overrun, period %u ms\n", i,
+          (unsigned long long) hdr->lost, (unsigned long long) hdr->sequence,
+          (unsigned long long) hdr->overruns, hdr->period_ms);
+  if(hdr->period_max_ms > 0)
+    fprintf(stderr, "adaptive period %u-%u ms\n", hdr->period_min_ms, hdr->period_max_ms);
 
   // Close the char device
-  buf_exit();
+  buf_exit(hdr);
+  return 0;
 }
-
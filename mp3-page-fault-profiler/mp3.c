@@ -6,14 +6,28 @@
 #include <linux/uaccess.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
 #include <linux/workqueue.h>
 #include <linux/vmalloc.h>
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/mm.h>
+#include <linux/mmu_notifier.h>
+#include <linux/page_idle.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/kprobes.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/seq_file.h>
+#include <linux/capability.h>
+#include <linux/cred.h>
+#include <linux/version.h>
 
 #include "mp3_given.h"
+#include "mp3_buf.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("LUOJL");
@@ -22,178 +36,1835 @@ MODULE_DESCRIPTION("CS-423 MP3");
 #define PROC_FILE "status"
 #define PROC_DIR  "mp3"
 #define RW_BUFSIZE 512
-#define PROFILE_PERIOD_MS 50  // millisecond
-#define SAMPLE_BUFSIZE 128 * 4 * 1024
-#define MAX_SAMPLE_CNT 48000
+#define PROFILE_PERIOD_MS 50  // default, millisecond
+#define MAX_PERIOD_MS 60000
+#define ADAPT_FLT_PER_S 1000  // adaptive period: fault rate that halves it
+#define ADAPT_CPU_PCT 50      // adaptive period: cpu utilization that halves it
+#define SAMPLE_PAGES 128      // default data size
+#define MAX_SAMPLE_PAGES 16384
+#define HEAT_SIZE PAGE_ALIGN(sizeof(struct mp3_heat))
+#define BUF_LEN(pages) (PAGE_SIZE + (pages) * PAGE_SIZE + HEAT_SIZE)
+#define GROUP_THREADS 64     // threads of a group with their own records
+#define TASK_HASH_BITS 10
 #define DEVICE_NAME "node"
 #define CLASS_NAME "mp3_dev"
 
 static struct proc_dir_entry *proc_dir;
 static struct proc_dir_entry *proc_file;
 
+// Counters of one thread of a registered group at the previous sample
+struct mp3_thread {
+    pid_t tid;  // 0 is a free slot
+    unsigned int gen;  // sample the thread was last seen in
+    unsigned long cpu_us;
+    unsigned long maj_flt;
+    unsigned long min_flt;
+};
+
 typedef struct mp3_task_struct {
-    struct task_struct* linux_task;
+    struct task_struct* linux_task;  // referenced while registered, the leader of a group
     struct list_head lis;
-    pid_t pid;
-    unsigned long utime;
-    unsigned long stime;
+    struct hlist_node hnode;  // in the session's tasks_hash, by pid
+    struct rcu_head rcu;
+    atomic_t refs;  // the registry's, and wss_callback's while it scans
+    pid_t pid;  // tgid of a group
+    // a whole thread group, threads are found on every sample
+    int group;
+    struct mp3_thread *threads;  // GROUP_THREADS slots, only touched by the sampler
+    unsigned int thread_gen;
+    // counters at the previous sample, records hold the difference
+    unsigned long cpu_us;
     unsigned long maj_flt;
     unsigned long min_flt;
+    // working set estimation, only touched by wss_scan except wss_pages
+    unsigned long wss_cursor;  // next address to check
+    unsigned long wss_young;   // referenced pages found in the current sweep
+    unsigned long wss_pages;   // referenced pages of the last complete sweep
+    // thrashing control, only touched under task_list_lock
+    unsigned long ctl_maj_flt;  // counters at the previous control step
+    unsigned long ctl_cpu_us;
+    unsigned long ctl_window_maj;  // major faults in the last window
+    int ctl_allowed;            // the registrant may signal it, else never stopped
+    int ctl_stopped;            // SIGSTOPped by the controller
+    unsigned long ctl_stopped_at;  // jiffies
 } mp3_task;
 
-static LIST_HEAD(mp3_task_list);
-static DEFINE_MUTEX(task_list_lock);
-static int task_cnt = 0;
+/*
+ * A session is a set of registered tasks sampled into its own buffer. The
+ * default session is controlled through /proc/mp3/status and is what an
+ * open of /dev/node reads. Writing a command to an open /dev/node gives
+ * that file a private session with its own tasks, mode, period and buffer.
+ * It lives until the file is closed and its mappings are gone. One timer
+ * samples all sessions in a single pass, each on its own grid.
+ */
+struct mp3_session {
+    struct list_head lis;      // in mp3_sessions
+    struct list_head tasks;    // mp3_task, in registration order
+    DECLARE_HASHTABLE(tasks_hash, TASK_HASH_BITS);  // the same tasks by pid
+    int id;                    // 0 is the default session
+    int task_cnt;
+    int users;                 // open files and mappings
+    unsigned int period_ms;    // current period, moved by the sampler when adaptive
+    unsigned int adapt_min_ms; // adaptive period bounds, 0 for a fixed period
+    unsigned int adapt_max_ms;
+    u64 next_ns;               // next sample, 0 while no task is registered
+    void *buf;
+    unsigned long buf_len;     // header page + data + heat table
+    struct mp3_buf_header *hdr;
+    char *sample_buf;
+    struct mp3_heat *heat;
+    // the ring layout, the header is writable through the mapping so the kernel keeps its own copy
+    int mode;
+    u32 record_size;
+    unsigned long data_size;
+    unsigned long write_pos;   // producer % data_size
+    unsigned long ring_gen;    // bumped by __ring_reset, see device_read
+    u64 seen_folded;           // sum of cpu_stat seen already in heat->seen
+    struct mp3_cpu_stat __percpu *cpu_stat;
+    // MODE_PACKED encoder state, only touched by the sampler
+    u64 packed_ts;             // last timestamp as the decoder will see it
+    u32 packed_period_ms;      // period the decoder assumes, 0 forces a sync
+    u32 packed_idle;           // idle ticks not written yet
+    unsigned long packed_wss;  // wss of the last written sample
+};
+
+/*
+ * Per CPU counters of a session. The fault path counts every fault of the
+ * session's tasks for the heat table, and in MODE_CPUS by the CPU it
+ * happens on and the node the page ended up on. The sampler charges cpu
+ * time to the CPU a thread last ran on and keeps what it already reported.
+ */
+struct mp3_cpu_stat {
+    u64 seen;           // written by the fault path
+    u64 min_flt;
+    u64 maj_flt;
+    u64 remote_flt;     // page on another node than the CPU
+    u64 last_min_flt;   // the rest only by the sampler
+    u64 last_maj_flt;
+    u64 last_remote_flt;
+    u64 cpu_us;         // since the last record
+};
+
+/*
+ * Sessions and their tasks change under task_list_lock and are walked under
+ * RCU by the sampler and the fault path. Tasks are looked up by pid in the
+ * session's hash table, so registering, deregistering and checking the
+ * faulting task don't depend on how many tasks there are.
+ */
+static LIST_HEAD(mp3_sessions);
+static DEFINE_MUTEX(task_list_lock);
+static struct mp3_session default_session;
+static int session_ids = 0;
+static int task_total = 0;  // tasks of all sessions
+
+/*
+ * The timer only takes the time and queues sample_work, which samples the
+ * sessions under task_list_lock and sets the timer again. It runs on the
+ * high priority system queue, so a working set scan on wq doesn't hold it
+ * up.
+ */
+static struct hrtimer sample_timer;
+static u64 sample_now;  // expiry time of the timer, ns
+static void sample_callback(struct work_struct *work);
+static DECLARE_WORK(sample_work, sample_callback);
+static struct workqueue_struct *wq;
+
+static unsigned int wss_interval_ms = 0;  // 0 is off
+static unsigned int wss_budget = 0;       // pages per scan
+static struct delayed_work *wss_work;
+
+// Thrashing controller, see ctl_callback
+#define CTL_UTIL_PCT 50  // default utilization below which faults count as thrashing
+#define CTL_EVENTS 8     // decisions kept for the status file
+
+struct ctl_event {
+    u64 time_ms;     // CLOCK_MONOTONIC
+    pid_t pid;
+    char action;     // 'S' stopped, 'C' continued
+    unsigned long maj_rate;  // aggregate major faults per second
+    unsigned long util;      // percent
+};
+
+static unsigned int ctl_interval_ms = 0;  // 0 is off
+static unsigned long ctl_maj_rate = 0;    // thrashing above this many major faults/s
+static unsigned long ctl_util = CTL_UTIL_PCT;  // ... while utilization stays below this
+static struct delayed_work *ctl_work;
+static u64 ctl_last_ns;
+static unsigned long ctl_last_maj_rate, ctl_last_util;
+static int ctl_stopped_cnt = 0;
+static unsigned long ctl_event_cnt = 0;
+static struct ctl_event ctl_events[CTL_EVENTS];
+
+/*
+ * Fault sampling runs in the fault path of registered tasks, on any CPU.
+ * Each CPU counts down to its next sampled fault, and only sampled faults
+ * take fault_lock. The rings in MODE_FAULTS, the heat tables and the
+ * buffer pointers of the sessions are only used there under fault_lock.
+ */
+static DEFINE_SPINLOCK(fault_lock);
+static u32 fault_rate = 0;       // 0 is off
+static DEFINE_PER_CPU(u32, fault_countdown);  // faults until the next sampled one
+static DECLARE_WAIT_QUEUE_HEAD(sample_wait);
+
+/*
+ * Fault service time of registered tasks while "L 1" is on, from the entry
+ * of handle_mm_fault to its return. Bucket i counts the faults that took
+ * less than 2^i ns (and at least 2^(i-1)), the last one everything longer.
+ * Each CPU updates its own copy, they are summed when read.
+ */
+#define LAT_BUCKETS 40
+#define FAULT_PROBE_ACTIVE 64  // kretprobe instances per CPU, faults can sleep
+
+struct fault_latency {
+    u64 minor[LAT_BUCKETS];
+    u64 major[LAT_BUCKETS];
+    u64 max_minor;  // ns
+    u64 max_major;
+};
+
+static DEFINE_PER_CPU(struct fault_latency, fault_lat);
+static int fault_lat_on = 0;
+
+static int dev_major;
+static struct class *dev_class = NULL;
+static struct device *mp3_dev = NULL;
+
+void reserve_pages(void *mem_start, unsigned long len) {
+    unsigned long i;
+    for(i = 0; i < len; i += PAGE_SIZE) {
+        SetPageReserved(vmalloc_to_page(mem_start+i));
+    }
+}
+
+void un_reserve_pages(void *mem_start, unsigned long len) {
+    unsigned long i;
+    for (i = 0; i < len; i += PAGE_SIZE) {
+        ClearPageReserved(vmalloc_to_page(mem_start+i));
+    }
+}
+
+void *alloc_buf(unsigned long len) {
+    void *mem = vmalloc(len);
+    if (mem == NULL) {
+        return NULL;
+    }
+    memset(mem, 0, len);
+    reserve_pages(mem, len);
+    return mem;
+}
+
+void free_buf(void *mem, unsigned long len) {
+    un_reserve_pages(mem, len);
+    vfree(mem);
+}
+
+// Empty the ring and set its record layout. Caller holds task_list_lock.
+void __ring_reset(struct mp3_session *s, int mode) {
+    struct mp3_buf_header *hdr = s->hdr;
+    int cpu;
+
+    s->ring_gen++;
+    s->mode = mode;
+    if (mode == MODE_PER_PID) {
+        s->record_size = sizeof(struct mp3_pid_record);
+    } else if (mode == MODE_PACKED) {
+        s->record_size = 1;
+    } else if (mode == MODE_FAULTS) {
+        s->record_size = sizeof(struct mp3_fault_record);
+    } else if (mode == MODE_CPUS) {
+        s->record_size = sizeof(struct mp3_cpu_record);
+    } else {
+        s->record_size = sizeof(struct mp3_aggr_record);
+    }
+    s->data_size = (s->buf_len - PAGE_SIZE - HEAT_SIZE) -
+                   (s->buf_len - PAGE_SIZE - HEAT_SIZE) % s->record_size;
+    hdr->mode = s->mode;
+    hdr->record_size = s->record_size;
+    hdr->data_offset = PAGE_SIZE;
+    hdr->data_size = s->data_size;
+    hdr->producer = 0;
+    hdr->consumer = 0;
+    hdr->sequence = 0;
+    hdr->lost = 0;
+    s->write_pos = 0;
+    s->packed_period_ms = 0;
+    s->packed_idle = 0;
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(s->cpu_stat, cpu), 0, sizeof(struct mp3_cpu_stat));
+    }
+    s->seen_folded = 0;
+}
+
+// Faults counted on any CPU since the last call
+u64 __fault_seen_delta(struct mp3_session *s) {
+    u64 seen = 0, delta;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        seen += READ_ONCE(per_cpu_ptr(s->cpu_stat, cpu)->seen);
+    }
+    delta = seen - s->seen_folded;
+    s->seen_folded = seen;
+    return delta;
+}
+
+// Add the faults the CPUs counted to heat->seen. Caller holds fault_lock.
+void __heat_fold_seen(struct mp3_session *s) {
+    s->heat->seen += __fault_seen_delta(s);
+}
+
+// Start sampling s into mem, a fresh buffer from alloc_buf. Caller holds task_list_lock and fault_lock.
+void __install_buf(struct mp3_session *s, void *mem, unsigned long len, int mode) {
+    s->buf = mem;
+    s->buf_len = len;
+    s->hdr = mem;
+    s->sample_buf = mem + PAGE_SIZE;
+    s->heat = mem + len - HEAT_SIZE;
+    s->hdr->magic = MP3_BUF_MAGIC;
+    s->hdr->version = MP3_BUF_VERSION;
+    s->hdr->period_ms = s->period_ms;
+    s->hdr->period_min_ms = s->adapt_min_ms;
+    s->hdr->period_max_ms = s->adapt_max_ms;
+    s->hdr->heat_offset = len - HEAT_SIZE;
+    s->hdr->heat_size = sizeof(struct mp3_heat);
+    s->hdr->wss_interval_ms = wss_interval_ms;
+    s->hdr->wss_budget = wss_budget;
+    s->heat->rate = fault_rate;
+    __ring_reset(s, mode);
+}
+
+// Append len bytes if the reader has made room for all of them
+int __ring_write_bytes(struct mp3_session *s, const void *data, unsigned long len) {
+    u64 producer = s->hdr->producer;
+    u64 consumer = READ_ONCE(s->hdr->consumer);
+    unsigned long size = s->data_size;
+    unsigned long first;
+
+    if (consumer > producer || producer - consumer + len > size) {
+        return -ENOSPC;
+    }
+    first = min(len, size - s->write_pos);
+    memcpy(s->sample_buf + s->write_pos, data, first);
+    memcpy(s->sample_buf, data + first, len - first);
+    s->write_pos += len;
+    if (s->write_pos >= size) {
+        s->write_pos -= size;
+    }
+    smp_store_release(&s->hdr->producer, producer + len);
+    return 0;
+}
+
+// Append one record, or count it as lost if the reader hasn't made room
+void __ring_write(struct mp3_session *s, const void *record) {
+    s->hdr->sequence++;
+    if (__ring_write_bytes(s, record, s->record_size) != 0) {
+        s->hdr->lost++;
+    }
+}
+
+int put_varint(u8 *p, u64 v) {
+    int len = 0;
+    while (v >= 0x80) {
+        p[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[len++] = v;
+    return len;
+}
+
+// Write a packed entry holding ticks samples, on failure make the next entry a sync
+int __packed_emit(struct mp3_session *s, u8 *entry, int len, u32 ticks) {
+    if (__ring_write_bytes(s, entry, len) != 0) {
+        s->hdr->lost += ticks;
+        s->packed_period_ms = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void __packed_flush(struct mp3_session *s) {
+    u8 entry[PACKED_VARINT_MAX];
+    int len;
+
+    if (s->packed_idle == 0) {
+        return;
+    }
+    len = put_varint(entry, (u64) s->packed_idle << 2 | PACKED_IDLE);
+    if (__packed_emit(s, entry, len, s->packed_idle) == 0) {
+        s->packed_ts += (u64) s->packed_idle * s->packed_period_ms * NSEC_PER_MSEC;
+    }
+    s->packed_idle = 0;
+}
+
+// Make the next entry a sync, for a reader joining the stream or after a gap in the ticks
+void __packed_resync(struct mp3_session *s) {
+    __packed_flush(s);
+    s->packed_period_ms = 0;
+}
+
+// Idle ticks are batched into one entry, other samples take a few bytes each
+void __packed_write(struct mp3_session *s, u64 now, u64 missed, unsigned long min_flt,
+                    unsigned long maj_flt, unsigned long cpu_us, unsigned long wss) {
+    u8 entry[6 * PACKED_VARINT_MAX];
+    u32 period = READ_ONCE(s->period_ms);
+    s64 jitter;
+    int len;
+
+    s->hdr->sequence++;
+    if (missed > 0) {
+        __packed_resync(s);  // an idle run can't span the gap
+    }
+    if (s->packed_period_ms == period && (min_flt | maj_flt | cpu_us) == 0 && wss == s->packed_wss) {
+        s->packed_idle++;
+        if (s->packed_idle * period >= PACKED_IDLE_MS) {
+            __packed_flush(s);
+        }
+        return;
+    }
+    __packed_flush(s);
+    if (s->packed_period_ms != period) {
+        len = put_varint(entry, (u64) period << 2 | PACKED_SYNC);
+        len += put_varint(entry + len, now);
+        s->packed_period_ms = period;
+    } else {
+        jitter = now - (s->packed_ts + (u64) period * NSEC_PER_MSEC);
+        len = put_varint(entry, ((u64) jitter << 1 ^ (u64) (jitter >> 63)) << 2 | PACKED_SAMPLE);
+    }
+    len += put_varint(entry + len, min_flt);
+    len += put_varint(entry + len, maj_flt);
+    len += put_varint(entry + len, cpu_us);
+    len += put_varint(entry + len, wss);
+    if (__packed_emit(s, entry, len, 1) == 0) {
+        s->packed_ts = now;
+        s->packed_wss = wss;
+    }
+}
+
+// Counters since the task started, summed over the threads of a group
+void task_counters(mp3_task *task, unsigned long *min_flt, unsigned long *maj_flt, unsigned long *cpu_us) {
+    if (task->group) {
+        get_group_counters(task->linux_task, min_flt, maj_flt, cpu_us);
+    } else {
+        get_task_counters(task->linux_task, min_flt, maj_flt, cpu_us);
+    }
+}
+
+// Increase of a counter since *last. Group sums can dip while a thread exits, that counts as none.
+unsigned long counter_delta(unsigned long now, unsigned long *last) {
+    unsigned long delta = 0;
+
+    if (now > *last) {
+        delta = now - *last;
+        *last = now;
+    }
+    return delta;
+}
+
+// Counters of the task since the previous call, 0 once it has exited. Only the sampler calls this.
+int sample_task(mp3_task *task, unsigned long *min_flt, unsigned long *maj_flt, unsigned long *cpu_us) {
+    unsigned long min, maj, cpu;
+
+    if (!pid_alive(task->linux_task)) {
+        return -1;
+    }
+    task_counters(task, &min, &maj, &cpu);
+    *min_flt = counter_delta(min, &task->min_flt);
+    *maj_flt = counter_delta(maj, &task->maj_flt);
+    *cpu_us = counter_delta(cpu, &task->cpu_us);
+    return 0;
+}
+
+// The slot of thread tid, a free one for a thread new since registration
+struct mp3_thread *thread_slot(mp3_task *task, pid_t tid) {
+    struct mp3_thread *free = NULL;
+    int i;
+
+    for (i = 0; i < GROUP_THREADS; i++) {
+        if (task->threads[i].tid == tid) {
+            return &task->threads[i];
+        }
+        if (free == NULL && task->threads[i].tid == 0) {
+            free = &task->threads[i];
+        }
+    }
+    if (free != NULL) {
+        memset(free, 0, sizeof(*free));
+        free->tid = tid;
+    }
+    return free;
+}
+
+// One record per thread of a group, threads beyond GROUP_THREADS are only in the group's. Caller holds rcu_read_lock.
+void __sampling_threads(struct mp3_session *s, mp3_task *task, u64 now) {
+    struct mp3_pid_record rec;
+    struct mp3_thread *th;
+    struct task_struct *t;
+    unsigned long min, maj, cpu;
+    int i;
+
+    task->thread_gen++;
+    for_each_thread(task->linux_task, t) {
+        th = thread_slot(task, t->pid);
+        if (th == NULL) {
+            continue;
+        }
+        get_task_counters(t, &min, &maj, &cpu);
+        rec.timestamp = now;
+        rec.pid = t->pid;
+        rec.min_flt = counter_delta(min, &th->min_flt);
+        rec.maj_flt = counter_delta(maj, &th->maj_flt);
+        rec.cpu_time = counter_delta(cpu, &th->cpu_us);
+        rec.wss = 0;
+        rec.tgid = task->pid;
+        th->gen = task->thread_gen;
+        __ring_write(s, &rec);
+    }
+    // free the slots of exited threads
+    for (i = 0; i < GROUP_THREADS; i++) {
+        if (task->threads[i].gen != task->thread_gen) {
+            task->threads[i].tid = 0;
+        }
+    }
+}
+
+// One compact record per task and tick, adds the faults and cpu time of all tasks to *flt and *cpu. Caller holds rcu_read_lock.
+void __sampling_per_pid(struct mp3_session *s, u64 now, unsigned long *flt, unsigned long *cpu) {
+    struct mp3_pid_record rec;
+    mp3_task *task;
+    unsigned long min_flt, maj_flt, cpu_us;
+
+    list_for_each_entry_rcu(task, &s->tasks, lis) {
+        if (sample_task(task, &min_flt, &maj_flt, &cpu_us) != 0) {
+            continue;
+        }
+        *flt += min_flt + maj_flt;
+        *cpu += cpu_us;
+        rec.timestamp = now;
+        rec.pid = task->pid;
+        rec.min_flt = min_flt;
+        rec.maj_flt = maj_flt;
+        rec.cpu_time = cpu_us;
+        rec.wss = READ_ONCE(task->wss_pages);
+        rec.tgid = 0;
+        __ring_write(s, &rec);
+        if (task->group) {
+            __sampling_threads(s, task, now);
+        }
+    }
+}
+
+// Charge the cpu time of task since the previous call to the CPUs its threads last ran on
+void __charge_cpus(struct mp3_session *s, mp3_task *task, unsigned long cpu_us) {
+    struct mp3_thread *th;
+    struct task_struct *t;
+    unsigned long min, maj, cpu;
+    int i;
+
+    if (!task->group) {
+        per_cpu_ptr(s->cpu_stat, task_cpu(task->linux_task))->cpu_us += cpu_us;
+        return;
+    }
+    // threads without a slot and exited ones are charged to the leader's CPU
+    task->thread_gen++;
+    for_each_thread(task->linux_task, t) {
+        th = thread_slot(task, t->pid);
+        if (th == NULL) {
+            continue;
+        }
+        get_task_counters(t, &min, &maj, &cpu);
+        cpu = min(counter_delta(cpu, &th->cpu_us), cpu_us);
+        per_cpu_ptr(s->cpu_stat, task_cpu(t))->cpu_us += cpu;
+        cpu_us -= cpu;
+        th->gen = task->thread_gen;
+    }
+    for (i = 0; i < GROUP_THREADS; i++) {
+        if (task->threads[i].gen != task->thread_gen) {
+            task->threads[i].tid = 0;
+        }
+    }
+    per_cpu_ptr(s->cpu_stat, task_cpu(task->linux_task))->cpu_us += cpu_us;
+}
+
+// One record per CPU that faulted or ran a task since the previous tick, adds the totals to *flt and *cpu. Caller holds rcu_read_lock.
+void __sampling_cpus(struct mp3_session *s, u64 now, unsigned long *flt, unsigned long *cpu) {
+    struct mp3_cpu_record rec;
+    struct mp3_cpu_stat *st;
+    mp3_task *task;
+    unsigned long min_flt, maj_flt, cpu_us;
+    u64 min, maj, remote;
+    int c;
+
+    list_for_each_entry_rcu(task, &s->tasks, lis) {
+        if (sample_task(task, &min_flt, &maj_flt, &cpu_us) == 0) {
+            __charge_cpus(s, task, cpu_us);
+        }
+    }
+    for_each_possible_cpu(c) {
+        st = per_cpu_ptr(s->cpu_stat, c);
+        min = READ_ONCE(st->min_flt);
+        maj = READ_ONCE(st->maj_flt);
+        remote = READ_ONCE(st->remote_flt);
+        if (min == st->last_min_flt && maj == st->last_maj_flt && st->cpu_us == 0) {
+            continue;
+        }
+        rec.timestamp = now;
+        rec.cpu = c;
+        rec.node = cpu_to_node(c);
+        rec.min_flt = min - st->last_min_flt;
+        rec.maj_flt = maj - st->last_maj_flt;
+        rec.remote_flt = remote - st->last_remote_flt;
+        rec.cpu_time = st->cpu_us;
+        __ring_write(s, &rec);
+        *flt += rec.min_flt + rec.maj_flt;
+        *cpu += st->cpu_us;
+        st->last_min_flt = min;
+        st->last_maj_flt = maj;
+        st->last_remote_flt = remote;
+        st->cpu_us = 0;
+    }
+}
+
+/*
+ * With an adaptive period, a tick whose fault rate or cpu utilization is
+ * high halves the period, down to adapt_min_ms, and a tick without faults
+ * and under 1% cpu doubles it, up to adapt_max_ms. Records carry their own
+ * timestamps, and a packed stream restarts with a sync at the new period.
+ */
+void __adapt_period(struct mp3_session *s, unsigned long flt, unsigned long cpu_us) {
+    u32 period = s->period_ms;
+    u64 period_us = (u64) period * USEC_PER_MSEC;
+
+    if (s->adapt_max_ms == 0) {
+        return;
+    }
+    if ((u64) flt * MSEC_PER_SEC >= (u64) ADAPT_FLT_PER_S * period ||
+        (u64) cpu_us * 100 >= ADAPT_CPU_PCT * period_us) {
+        period = max(period / 2, s->adapt_min_ms);
+    } else if (flt == 0 && (u64) cpu_us * 100 < period_us) {
+        period = min(period * 2, s->adapt_max_ms);
+    }
+    if (period != s->period_ms) {
+        WRITE_ONCE(s->period_ms, period);
+        WRITE_ONCE(s->hdr->period_ms, period);
+    }
+}
+
+/*
+ * Snapshots the counters into the ring, missed periods were skipped before
+ * this sample. The ring has no other writer while the session is sampled,
+ * see __stop_profiling. Caller holds task_list_lock and rcu_read_lock.
+ */
+void __sampling(struct mp3_session *s, u64 now, u64 missed) {
+    mp3_task *task;
+    unsigned long min_flt = 0, maj_flt = 0, cpu_time = 0, wss = 0;
+    unsigned long min, maj, cpu;
+    struct mp3_aggr_record rec;
+    unsigned long flags;
+
+    spin_lock_irqsave(&fault_lock, flags);
+    __heat_fold_seen(s);
+    spin_unlock_irqrestore(&fault_lock, flags);
+    if (s->mode == MODE_FAULTS) {
+        return;
+    }
+    if (s->mode == MODE_PER_PID) {
+        __sampling_per_pid(s, now, &min_flt, &cpu_time);
+        __adapt_period(s, min_flt, cpu_time);
+        return;
+    }
+    if (s->mode == MODE_CPUS) {
+        __sampling_cpus(s, now, &min_flt, &cpu_time);
+        __adapt_period(s, min_flt, cpu_time);
+        return;
+    }
+    list_for_each_entry_rcu(task, &s->tasks, lis) {
+        if (sample_task(task, &min, &maj, &cpu) == 0) {
+            min_flt  += min;
+            maj_flt  += maj;
+            cpu_time += cpu;
+            wss += READ_ONCE(task->wss_pages);
+        }
+    }
+    if (s->mode == MODE_PACKED) {
+        __packed_write(s, now, missed, min_flt, maj_flt, cpu_time, wss);
+    } else {
+        rec.timestamp = now;
+        rec.min_flt = min_flt;
+        rec.maj_flt = maj_flt;
+        rec.cpu_time = cpu_time;
+        rec.wss = wss;
+        __ring_write(s, &rec);
+    }
+    __adapt_period(s, min_flt + maj_flt, cpu_time);
+}
+
+/*
+ * Arm the timer for the earliest sample due, or stop it when nothing is
+ * profiled. Caller holds task_list_lock, which keeps sample_work out.
+ */
+void __arm_sampler(void) {
+    struct mp3_session *s;
+    u64 next = U64_MAX;
+
+    list_for_each_entry(s, &mp3_sessions, lis) {
+        if (s->next_ns > 0) {
+            next = min(next, s->next_ns);
+        }
+    }
+    if (next == U64_MAX) {
+        hrtimer_cancel(&sample_timer);
+    } else {
+        hrtimer_start(&sample_timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+    }
+}
+
+/*
+ * One pass over the sessions samples those that are due at the time the
+ * timer expired. Each session's samples stay on the grid set by
+ * __start_profiling, a late expiry skips periods instead of drifting. The
+ * next sample is one period, as left by the sample, after the one due. The
+ * timer is then set to the earliest next sample of any session.
+ */
+static void sample_callback(struct work_struct *work) {
+    struct mp3_session *s;
+    u64 now, period, missed;
+
+    mutex_lock(&task_list_lock);
+    now = READ_ONCE(sample_now);
+    rcu_read_lock();
+    list_for_each_entry_rcu(s, &mp3_sessions, lis) {
+        if (s->next_ns == 0 || s->next_ns > now) {
+            continue;
+        }
+        period = (u64) READ_ONCE(s->period_ms) * NSEC_PER_MSEC;
+        missed = div64_u64(now - s->next_ns, period);
+        s->next_ns += missed * period;
+        __sampling(s, now, missed);
+        s->next_ns += (u64) READ_ONCE(s->period_ms) * NSEC_PER_MSEC;
+        s->hdr->overruns += missed;
+    }
+    rcu_read_unlock();
+    __arm_sampler();
+    mutex_unlock(&task_list_lock);
+    wake_up_interruptible(&sample_wait);
+}
+
+// Hard irq context, the sampling itself is left to sample_work
+enum hrtimer_restart timer_callback(struct hrtimer *timer) {
+    WRITE_ONCE(sample_now, ktime_get_ns());
+    queue_work(system_highpri_wq, &sample_work);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Working set estimation. Every wss_interval_ms, wss_callback checks up to
+ * wss_budget pages of the registered tasks, resuming where it stopped, and
+ * clears the young bit of the referenced ones. A page found young has been
+ * used since the previous sweep, so the young pages of a whole sweep
+ * estimate the working set. Like reclaim on x86, the TLB isn't flushed, so
+ * a page used only through a cached TLB entry may be missed. Huge pages
+ * are left out.
+ *
+ * As in mm/page_idle.c, secondary MMUs are told through the mmu notifier
+ * and a page found young is marked with set_page_young, so reclaim still
+ * sees the reference the scan cleared. set_page_young needs
+ * CONFIG_IDLE_PAGE_TRACKING, without it the scan ages pages like reclaim's
+ * own check would.
+ */
+
+// Drops a reference to a task, the last one frees it
+void task_put(mp3_task *task) {
+    if (atomic_dec_and_test(&task->refs)) {
+        put_task_struct(task->linux_task);
+        kfree(task->threads);
+        kfree(task);
+    }
+}
+
+pmd_t *wss_find_pmd(struct mm_struct *mm, unsigned long addr) {
+    pgd_t *pgd;
+    pud_t *pud;
+    pmd_t *pmd;
+
+    pgd = pgd_offset(mm, addr);
+    if (pgd_none(*pgd) || pgd_bad(*pgd)) {
+        return NULL;
+    }
+    pud = pud_offset(pgd, addr);
+    if (pud_none(*pud) || pud_bad(*pud)) {
+        return NULL;
+    }
+    pmd = pmd_offset(pud, addr);
+    if (pmd_none(*pmd) || pmd_trans_huge(*pmd) || pmd_bad(*pmd)) {
+        return NULL;
+    }
+    return pmd;
+}
+
+// Check [addr, end) of vma, at most *budget pages. Returns where to resume.
+unsigned long wss_scan_range(struct vm_area_struct *vma, unsigned long addr, unsigned long end,
+                             unsigned long *budget, unsigned long *young) {
+    unsigned long next;
+    spinlock_t *ptl;
+    pte_t *start, *pte;
+    pmd_t *pmd;
+
+    while (addr < end && *budget > 0) {
+        next = pmd_addr_end(addr, end);
+        pmd = wss_find_pmd(vma->vm_mm, addr);
+        if (pmd == NULL) {
+            // no page table, skipping it costs about as much as one page
+            (*budget)--;
+            addr = next;
+            continue;
+        }
+        next = min(next, addr + *budget * PAGE_SIZE);
+        start = pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
+        for (; addr < next; addr += PAGE_SIZE, pte++) {
+            if (pte_present(*pte) && ptep_clear_young_notify(vma, addr, pte)) {
+                (*young)++;
+                if (pfn_valid(pte_pfn(*pte))) {
+                    set_page_young(pfn_to_page(pte_pfn(*pte)));
+                }
+            }
+            (*budget)--;
+        }
+        pte_unmap_unlock(start, ptl);
+    }
+    return addr;
+}
+
+// Continue the sweep over task's address space, publishing wss_pages when it completes
+void wss_scan_task(mp3_task *task, unsigned long budget) {
+    struct mm_struct *mm = get_task_mm(task->linux_task);
+    struct vm_area_struct *vma;
+    unsigned long addr = task->wss_cursor;
+
+    if (mm == NULL) {
+        return;
+    }
+    down_read(&mm->mmap_sem);
+    while (budget > 0) {
+        vma = find_vma(mm, addr);
+        if (vma == NULL) {
+            WRITE_ONCE(task->wss_pages, task->wss_young);
+            task->wss_young = 0;
+            addr = 0;
+            break;
+        }
+        addr = max(addr, vma->vm_start);
+        if (vma->vm_flags & (VM_IO | VM_PFNMAP | VM_HUGETLB)) {
+            addr = vma->vm_end;
+            continue;
+        }
+        addr = wss_scan_range(vma, addr, vma->vm_end, &budget, &task->wss_young);
+    }
+    task->wss_cursor = addr;
+    up_read(&mm->mmap_sem);
+    mmput(mm);
+}
+
+/*
+ * The budget is shared evenly by the tasks of all sessions. The tasks are
+ * collected under task_list_lock and scanned without it, so registration
+ * and the controller don't wait for the mmap_sem of every task.
+ */
+void wss_callback(struct work_struct *work) {
+    struct mp3_session *s;
+    mp3_task *task;
+    mp3_task **tasks = NULL;
+    unsigned long budget = 0;
+    int i, n = 0;
+
+    mutex_lock(&task_list_lock);
+    if (task_total > 0) {
+        tasks = kmalloc_array(task_total, sizeof(mp3_task *), GFP_KERNEL);
+        budget = max(wss_budget / task_total, 1U);
+    }
+    if (tasks != NULL) {
+        list_for_each_entry(s, &mp3_sessions, lis) {
+            list_for_each_entry(task, &s->tasks, lis) {
+                atomic_inc(&task->refs);
+                tasks[n++] = task;
+            }
+        }
+    }
+    mutex_unlock(&task_list_lock);
+
+    for (i = 0; i < n; i++) {
+        wss_scan_task(tasks[i], budget);
+        task_put(tasks[i]);
+        cond_resched();
+    }
+    kfree(tasks);
+    if (READ_ONCE(wss_interval_ms) > 0) {
+        queue_delayed_work(wq, wss_work, msecs_to_jiffies(wss_interval_ms));
+    }
+}
+
+/*
+ * Thrashing control. Every ctl_interval_ms, ctl_callback sums the major
+ * faults and cpu time of the tasks of all sessions over the window since its last
+ * run. Many major faults while the tasks get little cpu means they mostly
+ * wait for paging, so the task with the most major faults in the window is
+ * stopped with SIGSTOP, its memory can then be reclaimed for the others. At
+ * least one task is left running. Once the fault rate falls below half the
+ * threshold, the task stopped first is continued, one per window. Tasks are
+ * continued when they are deregistered or the controller is turned off.
+ */
+
+void __ctl_log(mp3_task *task, char action) {
+    struct ctl_event *e = &ctl_events[ctl_event_cnt % CTL_EVENTS];
+
+    e->time_ms = div_u64(ktime_get_ns(), NSEC_PER_MSEC);
+    e->pid = task->pid;
+    e->action = action;
+    e->maj_rate = ctl_last_maj_rate;
+    e->util = ctl_last_util;
+    ctl_event_cnt++;
+    printk(KERN_ALERT "thrashing control: %s pid %d, %lu major faults/s, %lu%% cpu\n",
+           action == 'S' ? "stop" : "continue", task->pid, ctl_last_maj_rate, ctl_last_util);
+}
+
+// Caller holds task_list_lock
+void __ctl_stop(mp3_task *task) {
+    send_sig(SIGSTOP, task->linux_task, 1);
+    task->ctl_stopped = 1;
+    task->ctl_stopped_at = jiffies;
+    ctl_stopped_cnt++;
+    __ctl_log(task, 'S');
+}
+
+// Caller holds task_list_lock
+void __ctl_continue(mp3_task *task) {
+    send_sig(SIGCONT, task->linux_task, 1);
+    task->ctl_stopped = 0;
+    ctl_stopped_cnt--;
+    __ctl_log(task, 'C');
+}
+
+void ctl_callback(struct work_struct *work) {
+    struct mp3_session *s;
+    mp3_task *task, *victim = NULL, *oldest = NULL;
+    unsigned long min, maj, cpu, maj_sum = 0, cpu_sum = 0;
+    u64 now = ktime_get_ns();
+    u64 window_us;
+
+    mutex_lock(&task_list_lock);
+    list_for_each_entry(s, &mp3_sessions, lis) {
+        list_for_each_entry(task, &s->tasks, lis) {
+            task_counters(task, &min, &maj, &cpu);
+            task->ctl_window_maj = counter_delta(maj, &task->ctl_maj_flt);
+            maj_sum += task->ctl_window_maj;
+            cpu_sum += counter_delta(cpu, &task->ctl_cpu_us);
+            if (task->ctl_stopped) {
+                if (oldest == NULL || time_before(task->ctl_stopped_at, oldest->ctl_stopped_at)) {
+                    oldest = task;
+                }
+            } else if (task->ctl_allowed &&
+                       (victim == NULL || task->ctl_window_maj > victim->ctl_window_maj)) {
+                victim = task;
+            }
+        }
+    }
+    window_us = div_u64(now - ctl_last_ns, NSEC_PER_USEC);
+    if (ctl_last_ns > 0 && window_us > 0) {
+        ctl_last_maj_rate = div64_u64((u64) maj_sum * USEC_PER_SEC, window_us);
+        ctl_last_util = div64_u64((u64) cpu_sum * 100, window_us * num_online_cpus());
+        if (ctl_last_maj_rate > ctl_maj_rate && ctl_last_util < ctl_util) {
+            if (victim != NULL && task_total - ctl_stopped_cnt > 1) {
+                __ctl_stop(victim);
+            }
+        } else if (ctl_last_maj_rate < ctl_maj_rate / 2 && oldest != NULL) {
+            __ctl_continue(oldest);
+        }
+    }
+    ctl_last_ns = now;
+    mutex_unlock(&task_list_lock);
+    if (READ_ONCE(ctl_interval_ms) > 0) {
+        queue_delayed_work(wq, ctl_work, msecs_to_jiffies(ctl_interval_ms));
+    }
+}
+
+// State carried from the entry of handle_mm_fault to its return
+struct fault_probe_data {
+    u64 start;  // ns
+    unsigned long address;
+    unsigned long vm_start;
+    unsigned long vm_end;
+};
+
+// current is registered by itself or with its thread group. Caller holds rcu_read_lock.
+int __session_has_current(struct mp3_session *s) {
+    mp3_task *task;
+    hash_for_each_possible_rcu(s->tasks_hash, task, hnode, current->pid) {
+        if (task->linux_task == current) {
+            return 1;
+        }
+    }
+    hash_for_each_possible_rcu(s->tasks_hash, task, hnode, current->tgid) {
+        if (task->group && task->pid == current->tgid) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Caller holds rcu_read_lock
+int __current_registered(void) {
+    struct mp3_session *s;
+    list_for_each_entry_rcu(s, &mp3_sessions, lis) {
+        if (__session_has_current(s)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The entry for the faulting VMA, added if missing. Caller holds fault_lock.
+struct mp3_vma_heat *__heat_vma(struct mp3_heat *heat, pid_t pid, unsigned long start, unsigned long end) {
+    struct mp3_vma_heat *v;
+    u32 i;
+
+    for (i = 0; i < heat->nr_vmas; i++) {
+        v = &heat->vmas[i];
+        if (v->pid == pid && v->start == start && v->end == end) {
+            return v;
+        }
+    }
+    if (heat->nr_vmas == HEAT_VMAS) {
+        return NULL;
+    }
+    v = &heat->vmas[heat->nr_vmas];
+    v->pid = pid;
+    v->start = start;
+    v->end = end;
+    smp_wmb();
+    heat->nr_vmas++;
+    return v;
+}
+
+/*
+ * The probe reads the arguments of handle_mm_fault from the x86-64 argument
+ * registers: (mm, vma, address, flags) before 4.8, (vma, address, flags)
+ * since.
+ */
+#ifndef CONFIG_X86_64
+#error "the handle_mm_fault probe reads x86-64 argument registers"
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+#define FAULT_ARG_VMA(regs) ((struct vm_area_struct *) (regs)->si)
+#define FAULT_ARG_ADDRESS(regs) ((regs)->dx)
+#else
+#define FAULT_ARG_VMA(regs) ((struct vm_area_struct *) (regs)->di)
+#define FAULT_ARG_ADDRESS(regs) ((regs)->si)
+#endif
+
+static int fault_entry(struct kretprobe_instance *ri, struct pt_regs *regs) {
+    struct fault_probe_data *d = (struct fault_probe_data *) ri->data;
+    struct vm_area_struct *vma = FAULT_ARG_VMA(regs);
+    int registered;
+
+    rcu_read_lock();
+    registered = __current_registered();
+    rcu_read_unlock();
+    if (!registered) {
+        return 1;  // skip fault_return
+    }
+    d->address = FAULT_ARG_ADDRESS(regs);
+    d->vm_start = vma->vm_start;
+    d->vm_end = vma->vm_end;
+    d->start = ktime_get_ns();
+    return 0;
+}
+
+// Kretprobe handlers run with preemption off, so this CPU's histogram is ours
+void __fault_latency_add(u64 ns, int major) {
+    struct fault_latency *lat = this_cpu_ptr(&fault_lat);
+    int bucket = min(fls64(ns), LAT_BUCKETS - 1);
+
+    if (major) {
+        lat->major[bucket]++;
+        lat->max_major = max(lat->max_major, ns);
+    } else {
+        lat->minor[bucket]++;
+        lat->max_minor = max(lat->max_minor, ns);
+    }
+}
+
+// Node of the page mapped at addr, NUMA_NO_NODE for none or a huge page. The faulting task holds mmap_sem.
+int fault_page_nid(struct mm_struct *mm, unsigned long addr) {
+    int nid = NUMA_NO_NODE;
+    pmd_t *pmd;
+    pte_t *pte;
+
+    pmd = wss_find_pmd(mm, addr);
+    if (pmd == NULL) {
+        return nid;
+    }
+    pte = pte_offset_map(pmd, addr);
+    if (pte_present(*pte) && pfn_valid(pte_pfn(*pte))) {
+        nid = page_to_nid(pfn_to_page(pte_pfn(*pte)));
+    }
+    pte_unmap(pte);
+    return nid;
+}
+
+// Count the fault in this CPU's MODE_CPUS counters of s. Only the fault path on this CPU writes them, kretprobe handlers run with preemption off.
+void fault_cpu_add(struct mp3_session *s, int major, int nid) {
+    struct mp3_cpu_stat *st = this_cpu_ptr(s->cpu_stat);
+
+    if (major) {
+        WRITE_ONCE(st->maj_flt, st->maj_flt + 1);
+    } else {
+        WRITE_ONCE(st->min_flt, st->min_flt + 1);
+    }
+    if (nid != NUMA_NO_NODE && nid != numa_node_id()) {
+        WRITE_ONCE(st->remote_flt, st->remote_flt + 1);
+    }
+}
+
+// Put a sampled fault in a session's heat table and MODE_FAULTS ring. Caller holds fault_lock.
+void __fault_sample(struct mp3_session *s, struct fault_probe_data *d, int major) {
+    struct mp3_heat *heat = s->heat;
+    struct mp3_fault_record rec;
+    struct mp3_vma_heat *v;
+    unsigned long bucket;
+
+    heat->sampled++;
+
+    v = __heat_vma(heat, current->pid, d->vm_start, d->vm_end);
+    if (v == NULL) {
+        heat->no_slot++;
+    } else {
+        bucket = (d->address - d->vm_start) * HEAT_BUCKETS / (d->vm_end - d->vm_start);
+        bucket = min(bucket, HEAT_BUCKETS - 1UL);
+        if (major) {
+            v->major++;
+            v->bucket_major[bucket]++;
+        } else {
+            v->minor++;
+            v->bucket_minor[bucket]++;
+        }
+    }
+    if (s->mode == MODE_FAULTS) {
+        rec.timestamp = ktime_get_ns();
+        rec.address = d->address & PAGE_MASK;
+        rec.pid = current->pid;
+        rec.flags = major ? FAULT_MAJOR : 0;
+        __ring_write(s, &rec);
+    }
+}
+
+static int fault_return(struct kretprobe_instance *ri, struct pt_regs *regs) {
+    struct fault_probe_data *d = (struct fault_probe_data *) ri->data;
+    unsigned long ret = regs_return_value(regs);
+    u32 *countdown = this_cpu_ptr(&fault_countdown);
+    u32 rate = READ_ONCE(fault_rate);
+    struct mp3_session *s;
+    unsigned long flags;
+    int major = (ret & VM_FAULT_MAJOR) != 0;
+    int nid = NUMA_NO_NODE;
+    int sampled;
+
+    if (ret & VM_FAULT_ERROR) {
+        return 0;
+    }
+    // a fault that waited for I/O and is retried counts as major, the retry on its own
+    if (READ_ONCE(fault_lat_on)) {
+        __fault_latency_add(ktime_get_ns() - d->start, major);
+    }
+    // a retried fault comes back through handle_mm_fault
+    if (ret & VM_FAULT_RETRY) {
+        return 0;
+    }
+    // kretprobe handlers run with preemption off, so the countdown is this CPU's
+    sampled = rate > 0 && (*countdown == 0 || --*countdown == 0);
+    if (sampled) {
+        *countdown = rate;
+    }
+    rcu_read_lock();
+    list_for_each_entry_rcu(s, &mp3_sessions, lis) {
+        if (!__session_has_current(s)) {
+            continue;
+        }
+        this_cpu_ptr(s->cpu_stat)->seen++;
+        if (s->mode == MODE_CPUS) {
+            if (nid == NUMA_NO_NODE) {
+                nid = fault_page_nid(current->mm, d->address);
+            }
+            fault_cpu_add(s, major, nid);
+        }
+        if (sampled) {
+            spin_lock_irqsave(&fault_lock, flags);
+            __fault_sample(s, d, major);
+            spin_unlock_irqrestore(&fault_lock, flags);
+        }
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
+static struct kretprobe fault_probe = {
+    .kp.symbol_name = "handle_mm_fault",
+    .entry_handler = fault_entry,
+    .handler = fault_return,
+    .data_size = sizeof(struct fault_probe_data),
+};
+
+// A session is sampled while it has tasks. Caller holds task_list_lock.
+void __start_profiling(struct mp3_session *s) {
+    printk(KERN_ALERT "start profiling session %d...\n", s->id);
+    s->packed_period_ms = 0;  // restart the packed stream with a sync
+    s->next_ns = ktime_get_ns() + (u64) s->period_ms * NSEC_PER_MSEC;
+    __arm_sampler();
+}
+
+// Once this returns the ring of s is only touched by callers holding task_list_lock
+void __stop_profiling(struct mp3_session *s) {
+    unsigned long flags;
+
+    s->next_ns = 0;
+    __packed_flush(s);
+    spin_lock_irqsave(&fault_lock, flags);
+    __heat_fold_seen(s);
+    spin_unlock_irqrestore(&fault_lock, flags);
+    __arm_sampler();
+    printk(KERN_ALERT "stop profiling session %d...\n", s->id);
+}
+
+// Caller holds task_list_lock
+mp3_task *__find_task(struct mp3_session *s, pid_t pid) {
+    mp3_task *task;
+    hash_for_each_possible(s->tasks_hash, task, hnode, pid) {
+        if (task->pid == pid) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+int __add_task(struct mp3_session *s, mp3_task *task) {
+    mutex_lock(&task_list_lock);
+    if (__find_task(s, task->pid) != NULL) {
+        mutex_unlock(&task_list_lock);
+        return -EEXIST;
+    }
+    printk(KERN_ALERT "add task, pid: %d\n", task->pid);
+    list_add_tail_rcu(&task->lis, &s->tasks);
+    hash_add_rcu(s->tasks_hash, &task->hnode, task->pid);
+    s->task_cnt += 1;
+    task_total += 1;
+    if (s->task_cnt == 1) {
+        __start_profiling(s);
+    }
+    mutex_unlock(&task_list_lock);
+    return 0;
+}
+
+void free_task(struct rcu_head *rcu) {
+    task_put(container_of(rcu, mp3_task, rcu));
+}
+
+void __del_task(struct mp3_session *s, pid_t pid) {
+    mp3_task *task;
+
+    mutex_lock(&task_list_lock);
+    task = __find_task(s, pid);
+    if (task != NULL) {
+        if (task->ctl_stopped) {
+            __ctl_continue(task);
+        }
+        list_del_rcu(&task->lis);
+        hash_del_rcu(&task->hnode);
+        call_rcu(&task->rcu, free_task);
+        printk(KERN_ALERT "deleted task, pid: %d\n", pid);
+        s->task_cnt -= 1;
+        task_total -= 1;
+        if (s->task_cnt == 0) {
+            __stop_profiling(s);
+        }
+    }
+    mutex_unlock(&task_list_lock);
+}
+
+// Deregister every task of s. Caller holds task_list_lock.
+void __free_tasks(struct mp3_session *s) {
+    mp3_task *task, *tmp;
+
+    list_for_each_entry_safe(task, tmp, &s->tasks, lis) {
+        if (task->ctl_stopped) {
+            __ctl_continue(task);
+        }
+        list_del_rcu(&task->lis);
+        hash_del_rcu(&task->hnode);
+        call_rcu(&task->rcu, free_task);
+    }
+    task_total -= s->task_cnt;
+    if (s->task_cnt > 0) {
+        s->task_cnt = 0;
+        __stop_profiling(s);
+    }
+}
+
+// Threads present now only count what happens after registration, later ones from their start
+void seed_threads(mp3_task *task) {
+    struct task_struct *t;
+    struct mp3_thread *th;
+
+    rcu_read_lock();
+    for_each_thread(task->linux_task, t) {
+        th = thread_slot(task, t->pid);
+        if (th != NULL) {
+            get_task_counters(t, &th->min_flt, &th->maj_flt, &th->cpu_us);
+        }
+    }
+    rcu_read_unlock();
+}
+
+// Register the task pid, or with group its whole thread group. A pid is registered once per session.
+/*
+ * Whether the current process may send p a signal, the check kill() does:
+ * CAP_KILL, or its real or effective uid matches the real or saved uid
+ * of p. The controller's signals skip that check.
+ */
+int may_signal(struct task_struct *p) {
+    const struct cred *cred = current_cred(), *tcred;
+    int ok;
+
+    if (capable(CAP_KILL)) {
+        return 1;
+    }
+    rcu_read_lock();
+    tcred = __task_cred(p);
+    ok = uid_eq(cred->euid, tcred->suid) || uid_eq(cred->euid, tcred->uid) ||
+         uid_eq(cred->uid, tcred->suid) || uid_eq(cred->uid, tcred->uid);
+    rcu_read_unlock();
+    return ok;
+}
+
+int action_register(struct mp3_session *s, pid_t pid, int group) {
+    struct task_struct *linux_task;
+    mp3_task *task;
+    int ret;
+
+    rcu_read_lock();
+    linux_task = find_task_by_pid(pid);
+    if (linux_task != NULL && group) {
+        linux_task = linux_task->group_leader;
+    }
+    if (linux_task != NULL) {
+        get_task_struct(linux_task);
+    }
+    rcu_read_unlock();
+    if (linux_task == NULL) {
+        return -ESRCH;
+    }
+    task = (mp3_task *) kzalloc(sizeof(mp3_task), GFP_KERNEL);
+    if (task != NULL && group) {
+        task->group = 1;
+        task->threads = kcalloc(GROUP_THREADS, sizeof(struct mp3_thread), GFP_KERNEL);
+    }
+    if (task == NULL || (group && task->threads == NULL)) {
+        put_task_struct(linux_task);
+        kfree(task);
+        return -ENOMEM;
+    }
+    task->pid = group ? linux_task->tgid : pid;
+    task->linux_task = linux_task;
+    task->ctl_allowed = may_signal(linux_task);
+    atomic_set(&task->refs, 1);
+    if (group) {
+        seed_threads(task);
+    }
+    // the first sample only counts what happens after registration
+    task_counters(task, &task->min_flt, &task->maj_flt, &task->cpu_us);
+    task->ctl_maj_flt = task->maj_flt;
+    task->ctl_cpu_us = task->cpu_us;
+    ret = __add_task(s, task);
+    if (ret) {
+        put_task_struct(linux_task);
+        kfree(task->threads);
+        kfree(task);
+    }
+    return ret;
+}
+
+void action_deregister(struct mp3_session *s, pid_t pid) {
+    __del_task(s, pid);
+}
 
-static struct workqueue_struct *wq;
-static struct delayed_work *profiling_work;
+// Upper bound in ns of the bucket holding the pct percentile of count faults
+u64 latency_percentile(const u64 *hist, u64 count, int pct) {
+    u64 rank = max(div_u64(count * pct + 99, 100), 1ULL);
+    u64 seen = 0;
+    int i;
 
-static unsigned long *sample_buf;
-static int sample_index = 0;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= rank) {
+            return 1ULL << i;
+        }
+    }
+    return 0;
+}
 
-static int dev_major;
-static struct class *dev_class = NULL;
-static struct device *mp3_dev = NULL;
+void latency_line(struct seq_file *m, const char *name, const u64 *hist, u64 max_ns) {
+    u64 count = 0;
+    int i;
 
-void sampling(void) {
-    mp3_task *task;
-    struct list_head *ptr;
-    int r;
-    unsigned long cur_jiff, min_flt, maj_flt, cpu_time;
-    cur_jiff = jiffies;
-    min_flt  = 0;
-    maj_flt  = 0;
-    cpu_time = 0;
-    mutex_lock(&task_list_lock);
-    list_for_each(ptr, &mp3_task_list) {
-        task = list_entry(ptr, mp3_task, lis);
-        cur_jiff = jiffies;
-        r = get_cpu_use(task->pid, &(task->min_flt), &(task->maj_flt), &(task->utime), &(task->stime));
-        if (r == 0) {
-            min_flt  += task->min_flt;
-            maj_flt  += task->maj_flt;
-            cpu_time += (task->utime + task->stime);
-        }
-    }
-    sample_buf[sample_index++] = cur_jiff;
-    sample_buf[sample_index++] = min_flt;
-    sample_buf[sample_index++] = maj_flt;
-    sample_buf[sample_index++] = cpu_time;
-    sample_index = sample_index % MAX_SAMPLE_CNT;
-    mutex_unlock(&task_list_lock);
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        count += hist[i];
+    }
+    seq_printf(m, "latency %s: %llu faults, p50 %llu ns, p99 %llu ns, max %llu ns\n",
+               name, count, latency_percentile(hist, count, 50),
+               latency_percentile(hist, count, 99), max_ns);
 }
 
-void work_callback(struct work_struct *work) {
-    sampling();
-    queue_delayed_work(wq, profiling_work, msecs_to_jiffies(PROFILE_PERIOD_MS));
+// The per CPU histograms summed, a "latency" line each for minor and major faults and one for the missed ones
+void latency_status(struct seq_file *m) {
+    struct fault_latency *sum, *lat;
+    int cpu, i;
+
+    sum = kzalloc(sizeof(struct fault_latency), GFP_KERNEL);
+    if (sum == NULL) {
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        lat = per_cpu_ptr(&fault_lat, cpu);
+        for (i = 0; i < LAT_BUCKETS; i++) {
+            sum->minor[i] += READ_ONCE(lat->minor[i]);
+            sum->major[i] += READ_ONCE(lat->major[i]);
+        }
+        sum->max_minor = max(sum->max_minor, READ_ONCE(lat->max_minor));
+        sum->max_major = max(sum->max_major, READ_ONCE(lat->max_major));
+    }
+    latency_line(m, "minor", sum->minor, sum->max_minor);
+    latency_line(m, "major", sum->major, sum->max_major);
+    // faults entered while all probe instances were in use, neither timed nor sampled
+    seq_printf(m, "latency missed: %d faults\n", READ_ONCE(fault_probe.nmissed));
+    kfree(sum);
 }
 
-int __add_task(mp3_task *task) {
-    printk(KERN_ALERT "add task, pid: %d\n", task->pid);
+/*
+ * /proc/mp3/status: one line per pid registered in the default session,
+ * " stopped" if the thrashing controller holds it, then the trailer: a line
+ * per private session, the controller's last window and recent decisions
+ * when it is on, and the fault latency lines with "L 1". It is a seq_file,
+ * so any number of pids is listed, a page at a time under task_list_lock.
+ */
+static void *status_start(struct seq_file *m, loff_t *pos) {
+    struct list_head *lh;
+    loff_t n = *pos;
+
     mutex_lock(&task_list_lock);
-    list_add(&(task->lis), &mp3_task_list);
-    task_cnt += 1;
+    list_for_each(lh, &default_session.tasks) {
+        if (n-- == 0) {
+            return lh;
+        }
+    }
+    // the list head stands for the trailer
+    return n == 0 ? &default_session.tasks : NULL;
+}
+
+static void *status_next(struct seq_file *m, void *v, loff_t *pos) {
+    struct list_head *lh = v;
+
+    ++*pos;
+    return lh == &default_session.tasks ? NULL : lh->next;
+}
+
+static void status_stop(struct seq_file *m, void *v) {
     mutex_unlock(&task_list_lock);
-    return task_cnt;
 }
 
-int __del_task(pid_t pid) {
+void status_trailer(struct seq_file *m) {
+    struct mp3_session *s;
+    struct ctl_event *e;
+    unsigned long i;
+
+    list_for_each_entry(s, &mp3_sessions, lis) {
+        if (s != &default_session) {
+            seq_printf(m, "session %d: %d tasks, mode %u, period %u ms\n",
+                       s->id, s->task_cnt, s->mode, READ_ONCE(s->period_ms));
+        }
+    }
+    if (ctl_interval_ms > 0) {
+        seq_printf(m, "thrashing: %lu major faults/s, %lu%% cpu, %d stopped\n",
+                   ctl_last_maj_rate, ctl_last_util, ctl_stopped_cnt);
+        i = ctl_event_cnt > CTL_EVENTS ? ctl_event_cnt - CTL_EVENTS : 0;
+        for (; i < ctl_event_cnt; i++) {
+            e = &ctl_events[i % CTL_EVENTS];
+            seq_printf(m, "%llu %s %d %lu %lu\n", e->time_ms, e->action == 'S' ? "stop" : "continue",
+                       e->pid, e->maj_rate, e->util);
+        }
+    }
+    if (fault_lat_on) {
+        latency_status(m);
+    }
+}
+
+static int status_show(struct seq_file *m, void *v) {
     mp3_task *task;
-    struct list_head *ptr;
-    struct list_head *tmp;
+
+    if (v == &default_session.tasks) {
+        status_trailer(m);
+        return 0;
+    }
+    task = list_entry((struct list_head *) v, mp3_task, lis);
+    seq_printf(m, "%d%s\n", task->pid, task->ctl_stopped ? " stopped" : "");
+    return 0;
+}
+
+static const struct seq_operations status_seq_ops = {
+    .start = status_start,
+    .next = status_next,
+    .stop = status_stop,
+    .show = status_show,
+};
+
+static int file_open(struct inode *inode, struct file *file) {
+    return seq_open(file, &status_seq_ops);
+}
+
+// The probe is needed for fault sampling, latency or a session in MODE_CPUS. Caller holds task_list_lock.
+int __fault_probe_wanted(void) {
+    struct mp3_session *s;
+
+    if (fault_rate > 0 || fault_lat_on) {
+        return 1;
+    }
+    list_for_each_entry(s, &mp3_sessions, lis) {
+        if (s->mode == MODE_CPUS) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Register or unregister the probe after what needs it changed. Caller holds task_list_lock.
+int __fault_probe_update(int was_on) {
+    int on = __fault_probe_wanted();
+    int ret = 0;
+
+    if (on && !was_on) {
+        // the default of twice the CPUs runs out with many tasks waiting on I/O
+        fault_probe.maxactive = FAULT_PROBE_ACTIVE * num_possible_cpus();
+        ret = register_kretprobe(&fault_probe);
+        if (ret) {
+            printk(KERN_ALERT "fail to probe handle_mm_fault: %d\n", ret);
+        }
+    } else if (!on && was_on) {
+        unregister_kretprobe(&fault_probe);
+    }
+    return ret;
+}
+
+// The record layout only changes while nothing is sampled, unread records are dropped
+int action_set_mode(struct mp3_session *s, char mode) {
+    static const char modes[] = { 'A', 'P', 'C', 'F', 'N' };  // indexed by MODE_*
+    unsigned long flags;
+    int ret = -EINVAL;
+    int i, was_on;
 
     mutex_lock(&task_list_lock);
-    list_for_each_safe(ptr, tmp, &mp3_task_list) {
-        task = list_entry(ptr, mp3_task, lis);
-        if (task->pid == pid) {
-            list_del(ptr);
-            kfree(task);
-            printk(KERN_ALERT "deleted task, pid: %d\n", pid);
-            task_cnt -= 1;
+    was_on = __fault_probe_wanted();
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        if (modes[i] != mode) {
+            continue;
+        }
+        if (s->task_cnt > 0) {
+            ret = -EBUSY;
             break;
         }
+        // a fault of a task deregistered just now may still be in fault_return
+        spin_lock_irqsave(&fault_lock, flags);
+        __ring_reset(s, i);
+        spin_unlock_irqrestore(&fault_lock, flags);
+        // MODE_CPUS counts faults in the probe
+        ret = __fault_probe_update(was_on);
+        if (ret) {
+            spin_lock_irqsave(&fault_lock, flags);
+            __ring_reset(s, MODE_AGGREGATE);
+            spin_unlock_irqrestore(&fault_lock, flags);
+        }
     }
     mutex_unlock(&task_list_lock);
-    return task_cnt;
+    return ret;
 }
 
-void free_all_tasks(void) {
-    mp3_task *task;
-    struct list_head *ptr, *tmp;
+// Publish the fault rate in every session's heat table. Caller holds task_list_lock and fault_lock.
+void __set_fault_rate(u32 rate, int clear) {
+    struct mp3_session *s;
+    int cpu;
+
+    list_for_each_entry(s, &mp3_sessions, lis) {
+        if (clear) {
+            memset(s->heat, 0, sizeof(struct mp3_heat));
+            __fault_seen_delta(s);  // faults before now aren't counted
+        }
+        s->heat->rate = rate;
+    }
+    WRITE_ONCE(fault_rate, rate);
+    for_each_possible_cpu(cpu) {
+        *per_cpu_ptr(&fault_countdown, cpu) = rate;
+    }
+}
+
+// Sample 1 of every rate faults of registered tasks, 0 turns sampling off. Turning it on clears the heat tables.
+int action_set_fault_rate(unsigned long rate) {
+    unsigned long flags;
+    int was_on, ret;
+
+    if (rate > U32_MAX) {
+        return -EINVAL;
+    }
     mutex_lock(&task_list_lock);
-    list_for_each_safe(ptr, tmp, &mp3_task_list) {
-        task = list_entry(ptr, mp3_task, lis);
-        list_del(ptr);
-        kfree(task);
+    was_on = __fault_probe_wanted();
+    spin_lock_irqsave(&fault_lock, flags);
+    __set_fault_rate(rate, fault_rate == 0 && rate > 0);
+    spin_unlock_irqrestore(&fault_lock, flags);
+    ret = __fault_probe_update(was_on);
+    if (ret) {
+        spin_lock_irqsave(&fault_lock, flags);
+        __set_fault_rate(0, 0);
+        spin_unlock_irqrestore(&fault_lock, flags);
     }
     mutex_unlock(&task_list_lock);
+    return ret;
 }
 
-void start_profiling(void) {
-    printk(KERN_ALERT "start profiling...\n");
-    sample_index = 0;
-    queue_delayed_work(wq, profiling_work, msecs_to_jiffies(PROFILE_PERIOD_MS));
+// Measure the service time of every fault of registered tasks. Turning it on clears the histograms.
+int action_set_fault_latency(unsigned long on) {
+    int was_on, ret, cpu;
+
+    if (on > 1) {
+        return -EINVAL;
+    }
+    mutex_lock(&task_list_lock);
+    was_on = __fault_probe_wanted();
+    if (on && !fault_lat_on) {
+        for_each_possible_cpu(cpu) {
+            memset(per_cpu_ptr(&fault_lat, cpu), 0, sizeof(struct fault_latency));
+        }
+    }
+    WRITE_ONCE(fault_lat_on, on);
+    ret = __fault_probe_update(was_on);
+    if (ret) {
+        fault_lat_on = 0;
+    }
+    mutex_unlock(&task_list_lock);
+    return ret;
 }
 
-void stop_profiling(void) {
-    cancel_delayed_work_sync(profiling_work);
-    printk(KERN_ALERT "stop profiling...\n");
+// Takes effect from the next sample. With an adaptive period it is the starting point, kept within the bounds.
+int action_set_period(struct mp3_session *s, unsigned long ms) {
+    if (ms == 0 || ms > MAX_PERIOD_MS) {
+        return -EINVAL;
+    }
+    mutex_lock(&task_list_lock);
+    if (s->adapt_max_ms > 0) {
+        ms = clamp_t(unsigned long, ms, s->adapt_min_ms, s->adapt_max_ms);
+    }
+    WRITE_ONCE(s->period_ms, ms);
+    WRITE_ONCE(s->hdr->period_ms, ms);
+    mutex_unlock(&task_list_lock);
+    return 0;
 }
 
-void action_register(pid_t pid) {
-    struct task_struct *linux_task;
+// Let the sampler move the period between min_ms and max_ms, max_ms 0 fixes it where it is
+int action_set_adaptive(struct mp3_session *s, unsigned long min_ms, unsigned long max_ms) {
+    if (max_ms > MAX_PERIOD_MS || (max_ms > 0 && (min_ms == 0 || min_ms > max_ms))) {
+        return -EINVAL;
+    }
+    if (max_ms == 0) {
+        min_ms = 0;
+    }
+    mutex_lock(&task_list_lock);  // the sampler moves the period too
+    s->adapt_min_ms = min_ms;
+    s->adapt_max_ms = max_ms;
+    s->hdr->period_min_ms = min_ms;
+    s->hdr->period_max_ms = max_ms;
+    if (max_ms > 0) {
+        s->period_ms = clamp_t(unsigned int, s->period_ms, min_ms, max_ms);
+        s->hdr->period_ms = s->period_ms;
+    }
+    __arm_sampler();
+    mutex_unlock(&task_list_lock);
+    return 0;
+}
+
+// Scan budget pages every interval ms for the working set estimate, interval 0 turns it off
+int action_set_wss(unsigned long interval, unsigned long budget) {
+    struct mp3_session *s;
     mp3_task *task;
-    int exist_task_cnt;
 
-    linux_task = find_task_by_pid(pid);
-    if (linux_task != NULL) {
-        task = (mp3_task *) kmalloc(sizeof(mp3_task), GFP_KERNEL);
-        task->pid = pid;
-        task->linux_task = linux_task;
-        exist_task_cnt = __add_task(task);
+    if (interval > MAX_PERIOD_MS || budget > UINT_MAX || (interval > 0 && budget == 0)) {
+        return -EINVAL;
+    }
+    // the work takes task_list_lock, so stop it first
+    WRITE_ONCE(wss_interval_ms, 0);
+    cancel_delayed_work_sync(wss_work);
 
-        if (exist_task_cnt == 1) {
-            start_profiling();
+    mutex_lock(&task_list_lock);
+    wss_interval_ms = interval;
+    wss_budget = budget;
+    list_for_each_entry(s, &mp3_sessions, lis) {
+        s->hdr->wss_interval_ms = interval;
+        s->hdr->wss_budget = budget;
+        if (interval > 0) {
+            continue;
         }
+        list_for_each_entry(task, &s->tasks, lis) {
+            WRITE_ONCE(task->wss_pages, 0);
+            task->wss_young = 0;
+            task->wss_cursor = 0;
+        }
+    }
+    if (interval > 0) {
+        queue_delayed_work(wq, wss_work, msecs_to_jiffies(interval));
     }
+    mutex_unlock(&task_list_lock);
+    return 0;
 }
 
-void action_deregister(pid_t pid) {
-    int exist_task_cnt = __del_task(pid);;
-    if (exist_task_cnt == 0) {
-        stop_profiling();
+/*
+ * Stop tasks when major faults exceed maj_rate per second while their cpu
+ * utilization is below util percent, checked every interval ms. Interval 0
+ * turns the controller off and continues the stopped tasks. Anyone may
+ * register a pid, and the signals skip the permission check, so only an
+ * administrator may turn the controller on or off.
+ */
+int action_set_thrashing(unsigned long interval, unsigned long maj_rate, unsigned long util) {
+    struct mp3_session *s;
+    mp3_task *task;
+
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (interval > MAX_PERIOD_MS || util > 100 || (interval > 0 && maj_rate == 0)) {
+        return -EINVAL;
+    }
+    // the work takes task_list_lock, so stop it first
+    WRITE_ONCE(ctl_interval_ms, 0);
+    cancel_delayed_work_sync(ctl_work);
+
+    mutex_lock(&task_list_lock);
+    ctl_interval_ms = interval;
+    ctl_maj_rate = maj_rate;
+    ctl_util = util;
+    ctl_last_ns = 0;  // the first run only takes the counters
+    if (interval > 0) {
+        queue_delayed_work(wq, ctl_work, 0);
+    } else {
+        list_for_each_entry(s, &mp3_sessions, lis) {
+            list_for_each_entry(task, &s->tasks, lis) {
+                if (task->ctl_stopped) {
+                    __ctl_continue(task);
+                }
+            }
+        }
     }
+    mutex_unlock(&task_list_lock);
+    return 0;
 }
 
-static ssize_t file_read(struct file *file, char __user *buffer, size_t count, loff_t *data) {
-    char buf[RW_BUFSIZE];
-    int len = 0;
-    mp3_task *task;
-    struct list_head *ptr;
+/*
+ * Replace the buffer of s with one of pages data pages. Only allowed while
+ * nothing is sampled and nobody else uses the buffer: the default session
+ * may not be open or mapped, a private one not mapped.
+ */
+int action_set_bufsize(struct mp3_session *s, unsigned long pages) {
+    void *new_buf, *old_buf;
+    unsigned long old_len, flags;
+    int mode;
 
-    if (*data > 0 || count < RW_BUFSIZE) {
-        return 0;
+    if (pages == 0 || pages > MAX_SAMPLE_PAGES) {
+        return -EINVAL;
+    }
+    new_buf = alloc_buf(BUF_LEN(pages));
+    if (new_buf == NULL) {
+        return -ENOMEM;
     }
 
     mutex_lock(&task_list_lock);
-    list_for_each(ptr, &mp3_task_list) {
-        task = list_entry(ptr, mp3_task, lis);
-        len += sprintf(buf+len, "%d\n", task->pid);
+    if (s->task_cnt > 0 || s->users > (s == &default_session ? 0 : 1)) {
+        mutex_unlock(&task_list_lock);
+        free_buf(new_buf, BUF_LEN(pages));
+        return -EBUSY;
     }
+    old_buf = s->buf;
+    old_len = s->buf_len;
+    mode = s->mode;
+    spin_lock_irqsave(&fault_lock, flags);
+    __install_buf(s, new_buf, BUF_LEN(pages), mode);
+    spin_unlock_irqrestore(&fault_lock, flags);
     mutex_unlock(&task_list_lock);
-    if (copy_to_user(buffer, buf, len)) {
-        return -EFAULT;
+
+    free_buf(old_buf, old_len);
+    printk(KERN_ALERT "session %d buffer resized to %lu pages\n", s->id, pages);
+    return 0;
+}
+
+/*
+ * Registration: "R PID"
+ * Thread group registration: "G PID"
+ * Unregistration: "U PID"
+ * Record mode: "M A" (aggregate, default), "M P" (per pid), "M C" (packed aggregate),
+ *              "M F" (fault addresses) or "M N" (per CPU and node)
+ * Sampling period: "P MS"
+ * Adaptive period: "A MIN_MS MAX_MS" or "A 0"
+ * Buffer size: "B PAGES"
+ * These apply to session s. The rest are global and only taken from /proc/mp3/status:
+ * Fault sampling: "F RATE"
+ * Fault latency: "L 1" or "L 0"
+ * Working set scan: "W INTERVAL_MS BUDGET_PAGES"
+ * Thrashing control: "T INTERVAL_MS MAJOR_FAULTS_PER_S [UTIL_PERCENT]"
+ */
+int run_command(struct mp3_session *s, char *buffer) {
+    char action, mode;
+    pid_t pid;
+    unsigned long arg, arg2, arg3;
+    int n;
+
+    n = sscanf(buffer, "%c %d", &action, &pid);
+    if (n >= 1 && strchr("FLWT", action) != NULL && s != &default_session) {
+        return -EPERM;
     }
-    *data += len;
-    return len;
+
+    if (action == 'M' && sscanf(buffer, "%c %c", &action, &mode) == 2) {
+        return action_set_mode(s, mode);
+    } else if (action == 'P' && sscanf(buffer, "%c %lu", &action, &arg) == 2) {
+        return action_set_period(s, arg);
+    } else if (action == 'A' && (n = sscanf(buffer, "%c %lu %lu", &action, &arg, &arg2)) >= 2) {
+        return action_set_adaptive(s, n == 3 ? arg : 0, n == 3 ? arg2 : arg);
+    } else if (action == 'B' && sscanf(buffer, "%c %lu", &action, &arg) == 2) {
+        return action_set_bufsize(s, arg);
+    } else if (action == 'F' && sscanf(buffer, "%c %lu", &action, &arg) == 2) {
+        return action_set_fault_rate(arg);
+    } else if (action == 'L' && sscanf(buffer, "%c %lu", &action, &arg) == 2) {
+        return action_set_fault_latency(arg);
+    } else if (action == 'W' && (n = sscanf(buffer, "%c %lu %lu", &action, &arg, &arg2)) >= 2) {
+        return action_set_wss(arg, n == 3 ? arg2 : 0);
+    } else if (action == 'T' && (n = sscanf(buffer, "%c %lu %lu %lu", &action, &arg, &arg2, &arg3)) >= 2) {
+        return action_set_thrashing(arg, n >= 3 ? arg2 : 0, n == 4 ? arg3 : CTL_UTIL_PCT);
+    } else if (action == 'R' && n == 2) {
+        return action_register(s, pid, 0);
+    } else if (action == 'G' && n == 2) {
+        return action_register(s, pid, 1);
+    } else if (action == 'U' && n == 2) {
+        action_deregister(s, pid);
+    } else {
+        printk(KERN_ALERT "fail to interpret command: %s\n", buffer);
+        return -EINVAL;
+    }
+    return 0;
 }
 
-static ssize_t file_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *data) {
+ssize_t write_command(struct mp3_session *s, const char __user *user_buffer, size_t count) {
     char buffer[RW_BUFSIZE];
     int buffer_size = count;
-    char action;
-    pid_t pid;
-    int n;
+    int ret;
 
     if (count > RW_BUFSIZE) {
         buffer_size = RW_BUFSIZE;
@@ -201,108 +1872,405 @@ static ssize_t file_write(struct file *file, const char __user *user_buffer, siz
     if (copy_from_user(buffer, user_buffer, buffer_size)) {
         return -EFAULT;
     }
-    n = sscanf(buffer, "%c %d", &action, &pid);
-
-    if (action == 'R' && n == 2) {
-        action_register(pid);
-    } else if (action == 'U' && n == 2) {
-        action_deregister(pid);
-    } else {
-        printk(KERN_ALERT "fail to interpret command: %s\n", buffer);
-        return -EINVAL;
+    buffer[buffer_size == RW_BUFSIZE ? RW_BUFSIZE - 1 : buffer_size] = '\0';
+    ret = run_command(s, buffer);
+    if (ret) {
+        return ret;
     }
     return buffer_size;
 }
 
+static ssize_t file_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *data) {
+    return write_command(&default_session, user_buffer, count);
+}
+
 static const struct file_operations file = {
     .owner = THIS_MODULE,
-    .read  = file_read,
+    .open  = file_open,
+    .read  = seq_read,
+    .llseek = seq_lseek,
+    .release = seq_release,
     .write = file_write,
 };
 
+// A private session with the default buffer size, mode and period
+struct mp3_session *session_create(void) {
+    struct mp3_session *s;
+    unsigned long flags;
+    void *mem;
+
+    s = kzalloc(sizeof(struct mp3_session), GFP_KERNEL);
+    mem = alloc_buf(BUF_LEN(SAMPLE_PAGES));
+    if (s != NULL) {
+        s->cpu_stat = alloc_percpu(struct mp3_cpu_stat);
+    }
+    if (s == NULL || mem == NULL || s->cpu_stat == NULL) {
+        if (s != NULL) {
+            free_percpu(s->cpu_stat);
+        }
+        kfree(s);
+        if (mem != NULL) {
+            free_buf(mem, BUF_LEN(SAMPLE_PAGES));
+        }
+        return NULL;
+    }
+    INIT_LIST_HEAD(&s->tasks);
+    hash_init(s->tasks_hash);
+    s->period_ms = PROFILE_PERIOD_MS;
+    s->users = 1;
+
+    mutex_lock(&task_list_lock);
+    s->id = ++session_ids;
+    spin_lock_irqsave(&fault_lock, flags);
+    __install_buf(s, mem, BUF_LEN(SAMPLE_PAGES), MODE_AGGREGATE);
+    spin_unlock_irqrestore(&fault_lock, flags);
+    list_add_tail_rcu(&s->lis, &mp3_sessions);
+    mutex_unlock(&task_list_lock);
+    return s;
+}
+
+// Drop a user of s. A private session goes away with its last one, deregistering its tasks.
+void session_put(struct mp3_session *s) {
+    int was_on;
+
+    mutex_lock(&task_list_lock);
+    s->users--;
+    if (s == &default_session || s->users > 0) {
+        mutex_unlock(&task_list_lock);
+        return;
+    }
+    __free_tasks(s);
+    was_on = __fault_probe_wanted();
+    list_del_rcu(&s->lis);
+    __fault_probe_update(was_on);
+    mutex_unlock(&task_list_lock);
+
+    // the fault path may still be writing to the ring
+    synchronize_rcu();
+    free_buf(s->buf, s->buf_len);
+    free_percpu(s->cpu_stat);
+    kfree(s);
+}
+
+// The session a file of /dev/node reads, the default one until a command is written to it
+struct mp3_session *file_session(struct file *filp) {
+    return filp->private_data != NULL ? filp->private_data : &default_session;
+}
+
+// A new reader of a packed stream can't time the entries before its first sync, so one follows
 static int device_open(struct inode *node, struct file *f) {
+    f->private_data = NULL;
+    mutex_lock(&task_list_lock);
+    default_session.users++;
+    if (default_session.mode == MODE_PACKED) {
+        __packed_resync(&default_session);
+    }
+    mutex_unlock(&task_list_lock);
     return 0;
 }
+
 static int device_release(struct inode *node, struct file *f) {
+    session_put(file_session(f));
     return 0;
 }
 
+// The first command written gives the file its private session
+static ssize_t device_write(struct file *filp, const char __user *ubuf, size_t count, loff_t *off) {
+    struct mp3_session *s;
+
+    if (filp->private_data == NULL) {
+        s = session_create();
+        if (s == NULL) {
+            return -ENOMEM;
+        }
+        mutex_lock(&task_list_lock);
+        if (filp->private_data == NULL) {
+            filp->private_data = s;
+            default_session.users--;
+            s = NULL;
+        }
+        mutex_unlock(&task_list_lock);
+        if (s != NULL) {
+            session_put(s);  // lost a race with another write
+        }
+    }
+    return write_command(filp->private_data, ubuf, count);
+}
+
+// A mapping keeps its session's buffer alive
+static void device_vma_open(struct vm_area_struct *vma) {
+    struct mp3_session *s = vma->vm_private_data;
+
+    mutex_lock(&task_list_lock);
+    s->users++;
+    mutex_unlock(&task_list_lock);
+}
+
+static void device_vma_close(struct vm_area_struct *vma) {
+    session_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct device_vm_ops = {
+    .open = device_vma_open,
+    .close = device_vma_close,
+};
+
 static int device_mmap(struct file *filp, struct vm_area_struct *vma) {
-    int index = 0;
-    void *buf_pos = sample_buf;
-    while (index < SAMPLE_BUFSIZE) {
+    struct mp3_session *s = file_session(filp);
+    unsigned long index = 0;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int ret = 0;
+
+    mutex_lock(&task_list_lock);
+    if (size > s->buf_len) {
+        mutex_unlock(&task_list_lock);
+        return -EINVAL;
+    }
+    while (index < size) {
         if (remap_pfn_range(vma, vma->vm_start + index,
-                vmalloc_to_pfn(buf_pos+index), PAGE_SIZE, vma->vm_page_prot)) {
+                vmalloc_to_pfn(s->buf+index), PAGE_SIZE, vma->vm_page_prot)) {
             printk(KERN_ALERT "fail to mmap\n");
-            return -EAGAIN;
+            ret = -EAGAIN;
+            break;
         }
         index += PAGE_SIZE;
     }
-    return 0;
+    if (ret == 0) {
+        vma->vm_ops = &device_vm_ops;
+        vma->vm_private_data = s;
+        s->users++;
+    }
+    mutex_unlock(&task_list_lock);
+    return ret;
+}
+
+// Readable once there are unread records. "B" may replace the buffer, so it is looked at under task_list_lock.
+static unsigned int device_poll(struct file *filp, poll_table *wait) {
+    struct mp3_session *s = file_session(filp);
+    unsigned int mask = 0;
+
+    poll_wait(filp, &sample_wait, wait);
+    mutex_lock(&task_list_lock);
+    if (smp_load_acquire(&s->hdr->producer) != READ_ONCE(s->hdr->consumer)) {
+        mask = POLLIN | POLLRDNORM;
+    }
+    mutex_unlock(&task_list_lock);
+    return mask;
+}
+
+/*
+ * Copy out unread data, whole records only, and consume it. With this the
+ * device also works with splice(), which copies through this read() on the
+ * kernels this module targets. A process should either read() or consume
+ * through the mapping, both move the same consumer index.
+ *
+ * The range is taken under task_list_lock, but copy_to_user may fault, so
+ * the copy runs without it. A users reference keeps the buffer from being
+ * reallocated meanwhile, and the producer doesn't touch unread data. The records are
+ * only consumed if the ring wasn't reset (a mode change) and no other
+ * reader consumed them meanwhile, else the read starts over. The consumer
+ * index comes from the mapping and is checked against the ring first, the
+ * sizes are the session's own.
+ */
+static ssize_t device_read(struct file *filp, char __user *ubuf, size_t count, loff_t *off) {
+    struct mp3_session *s = file_session(filp);
+    struct mp3_buf_header *hdr;
+    u64 producer, consumer, pos;
+    unsigned long size, len, first, gen;
+    u32 record_size;
+    int ret;
+
+    while (1) {
+        mutex_lock(&task_list_lock);
+        hdr = s->hdr;
+        producer = smp_load_acquire(&hdr->producer);
+        consumer = READ_ONCE(hdr->consumer);
+        size = s->data_size;
+        record_size = s->record_size;
+        // a reader moved consumer out of the ring, skip to the oldest data still there
+        if (consumer > producer || producer - consumer > size) {
+            if (s->mode == MODE_PACKED) {
+                // no entry boundary to land on, wait for a sync instead
+                __packed_resync(s);
+                producer = smp_load_acquire(&hdr->producer);
+                consumer = producer;
+            } else {
+                consumer = producer - min_t(u64, producer, size);
+            }
+            smp_store_release(&hdr->consumer, consumer);
+        }
+        len = min_t(u64, producer - consumer, min_t(u64, count, size));
+        len -= len % record_size;
+        gen = s->ring_gen;
+        if (len > 0) {
+            s->users++;
+        }
+        mutex_unlock(&task_list_lock);
+
+        if (len > 0) {
+            pos = consumer;
+            pos = do_div(pos, size);
+            first = min(len, size - (unsigned long) pos);
+            ret = copy_to_user(ubuf, s->sample_buf + pos, first) ||
+                  copy_to_user(ubuf + first, s->sample_buf, len - first);
+            mutex_lock(&task_list_lock);
+            s->users--;
+            if (ret) {
+                mutex_unlock(&task_list_lock);
+                return -EFAULT;
+            }
+            if (s->ring_gen == gen && hdr->consumer == consumer) {
+                smp_store_release(&hdr->consumer, consumer + len);
+                mutex_unlock(&task_list_lock);
+                return len;
+            }
+            mutex_unlock(&task_list_lock);
+            continue;
+        }
+        if (count < record_size) {
+            return -EINVAL;
+        }
+        if (filp->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        // the users reference keeps "B" from replacing hdr while it is waited on
+        mutex_lock(&task_list_lock);
+        s->users++;
+        hdr = s->hdr;
+        mutex_unlock(&task_list_lock);
+        ret = wait_event_interruptible(sample_wait,
+                smp_load_acquire(&hdr->producer) != READ_ONCE(hdr->consumer));
+        mutex_lock(&task_list_lock);
+        s->users--;
+        mutex_unlock(&task_list_lock);
+        if (ret) {
+            return ret;
+        }
+    }
 }
 
 static const struct file_operations device_fops = {
+    .owner = THIS_MODULE,
     .open = device_open,
     .release = device_release,
+    .read = device_read,
+    .write = device_write,
     .mmap = device_mmap,
+    .poll = device_poll,
 };
 
-void reserve_pages(void *mem_start, int len) {
-    int i;
-    for(i = 0; i < len; i += PAGE_SIZE) {
-        SetPageReserved(vmalloc_to_page(mem_start+i));
+int __init mp3_init(void) {
+    void *mem;
+    int ret = -ENOMEM;
+
+    printk(KERN_ALERT "MP3 MODULE INIT");
+
+    INIT_LIST_HEAD(&default_session.tasks);
+    hash_init(default_session.tasks_hash);
+    default_session.period_ms = PROFILE_PERIOD_MS;
+    default_session.cpu_stat = alloc_percpu(struct mp3_cpu_stat);
+    if (default_session.cpu_stat == NULL) {
+        return -ENOMEM;
     }
-}
+    mem = alloc_buf(BUF_LEN(SAMPLE_PAGES));
+    if (mem == NULL) {
+        goto err_percpu;
+    }
+    __install_buf(&default_session, mem, BUF_LEN(SAMPLE_PAGES), MODE_AGGREGATE);
 
-void un_reserve_pages(void *mem_start, int len) {
-    int i;
-    for (i = 0; i < len; i += PAGE_SIZE) {
-        ClearPageReserved(vmalloc_to_page(mem_start+i));
+    wq = create_workqueue("mp3_wq");
+    wss_work = kmalloc(sizeof(struct delayed_work), GFP_KERNEL);
+    ctl_work = kmalloc(sizeof(struct delayed_work), GFP_KERNEL);
+    if (wq == NULL || wss_work == NULL || ctl_work == NULL) {
+        goto err_work;
     }
-}
+    INIT_DELAYED_WORK(wss_work, wss_callback);
+    INIT_DELAYED_WORK(ctl_work, ctl_callback);
+    hrtimer_init(&sample_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    sample_timer.function = timer_callback;
+    list_add_rcu(&default_session.lis, &mp3_sessions);
 
-int __init mp3_init(void) {
     // register character device
     dev_major = register_chrdev(0, DEVICE_NAME, &device_fops);
+    if (dev_major < 0) {
+        ret = dev_major;
+        goto err_work;
+    }
     dev_class = class_create(THIS_MODULE, CLASS_NAME);
+    if (IS_ERR(dev_class)) {
+        ret = PTR_ERR(dev_class);
+        goto err_chrdev;
+    }
     mp3_dev = device_create(dev_class, NULL, MKDEV(dev_major, 0), NULL, DEVICE_NAME);
+    if (IS_ERR(mp3_dev)) {
+        ret = PTR_ERR(mp3_dev);
+        goto err_class;
+    }
 
-    // create proc file
-    printk(KERN_ALERT "MP3 MODULE INIT");
-
-    sample_buf = vmalloc(SAMPLE_BUFSIZE);
-    memset(sample_buf, -1, SAMPLE_BUFSIZE);
-    reserve_pages(sample_buf, SAMPLE_BUFSIZE);
-
-    wq = create_workqueue("mp3_wq");
-    profiling_work = kmalloc(sizeof(struct delayed_work), GFP_KERNEL);
-    INIT_DELAYED_WORK(profiling_work, work_callback);
-
+    // create proc file, commands may come in from here on
     proc_dir = proc_mkdir(PROC_DIR, NULL);
+    if (proc_dir == NULL) {
+        goto err_device;
+    }
     proc_file = proc_create(PROC_FILE, 0666, proc_dir, &file);
+    if (proc_file == NULL) {
+        proc_remove(proc_dir);
+        goto err_device;
+    }
     return 0;
+
+err_device:
+    device_destroy(dev_class, MKDEV(dev_major, 0));
+err_class:
+    class_destroy(dev_class);
+err_chrdev:
+    unregister_chrdev(dev_major, DEVICE_NAME);
+err_work:
+    if (wq != NULL) {
+        destroy_workqueue(wq);
+    }
+    kfree(wss_work);
+    kfree(ctl_work);
+    free_buf(default_session.buf, default_session.buf_len);
+err_percpu:
+    free_percpu(default_session.cpu_stat);
+    return ret;
 }
 
 void __exit mp3_exit(void) {
     // remove character device
     device_destroy(dev_class, MKDEV(dev_major, 0));
     class_destroy(dev_class);
-    class_unregister(dev_class);
     unregister_chrdev(dev_major, DEVICE_NAME);
 
     // remove proc file
     proc_remove(proc_file);
     proc_remove(proc_dir);
 
-    cancel_delayed_work_sync(profiling_work);
-    destroy_workqueue(wq);
+    WRITE_ONCE(wss_interval_ms, 0);
+    cancel_delayed_work_sync(wss_work);
+    WRITE_ONCE(ctl_interval_ms, 0);
+    cancel_delayed_work_sync(ctl_work);
+    if (__fault_probe_wanted()) {
+        unregister_kretprobe(&fault_probe);
+    }
 
-    free_all_tasks();
+    // open files hold the module, so only the default session is left
+    mutex_lock(&task_list_lock);
+    __free_tasks(&default_session);
+    mutex_unlock(&task_list_lock);
+    hrtimer_cancel(&sample_timer);
+    cancel_work_sync(&sample_work);
+    rcu_barrier();
+
+    destroy_workqueue(wq);
+    kfree(wss_work);
+    kfree(ctl_work);
 
-    un_reserve_pages(sample_buf, SAMPLE_BUFSIZE);
-    vfree(sample_buf);
+    free_buf(default_session.buf, default_session.buf_len);
+    free_percpu(default_session.cpu_stat);
     printk(KERN_ALERT "MP3 MODULE EXIT");
 }
 
 module_init(mp3_init);
-module_exit(mp3_exit);
\ No newline at end of file
+module_exit(mp3_exit);
@@ -0,0 +1,195 @@
+#ifndef __MP3_BUF_INCLUDE__
+#define __MP3_BUF_INCLUDE__
+
+#include <linux/types.h>
+
+/*
+ * Layout of the profiler buffer behind /dev/node, shared with monitor.
+ *
+ * Every session has its own buffer. An open file of /dev/node maps and
+ * reads the default session, the one /proc/mp3/status controls, until a
+ * command is written to the file. From then on the file has a private
+ * session, so a reader should write its commands before mapping.
+ *
+ * The first page holds a mp3_buf_header, the records follow at data_offset.
+ * The data area is a ring of data_size bytes. producer and consumer count
+ * the bytes ever written and consumed, so producer - consumer bytes are
+ * unread, starting at consumer % data_size. The module only writes
+ * producer, a reader only writes consumer. A record that doesn't fit in
+ * the free space is dropped and counted in lost instead of overwriting
+ * unread data. data_size is a multiple of record_size, so fixed size
+ * records never wrap around. Entries of MODE_PACKED may.
+ *
+ * The geometry changes when the buffer is resized, so a reader should map
+ * the header page first and then up to heat_offset + heat_size bytes.
+ * The heat table (struct mp3_heat) follows the data area.
+ */
+
+#define MP3_BUF_MAGIC 0x6d703362  // "mp3b"
+#define MP3_BUF_VERSION 10
+
+#define MODE_AGGREGATE 0  // one mp3_aggr_record per tick for all tasks
+#define MODE_PER_PID   1  // one mp3_pid_record per tick for each task
+#define MODE_PACKED    2  // aggregate samples as a byte stream, see below
+#define MODE_FAULTS    3  // one mp3_fault_record per sampled page fault
+#define MODE_CPUS      4  // one mp3_cpu_record per tick for each busy CPU
+
+struct mp3_buf_header {
+    __u32 magic;
+    __u32 version;
+    __u32 mode;
+    __u32 record_size;
+    __u32 period_ms;  // sampling period, current one when adaptive
+    __u64 data_offset;
+    __u64 data_size;
+    __u64 producer;
+    __u64 consumer;
+    __u64 sequence;  // records produced, including lost ones
+    __u64 lost;
+    __u64 overruns;  // sampling periods skipped because the timer fired late
+    __u64 heat_offset;
+    __u64 heat_size;
+    __u32 wss_interval_ms;  // working set scan, 0 when off
+    __u32 wss_budget;       // pages checked per scan
+    __u32 period_min_ms;    // adaptive period bounds, 0 when fixed
+    __u32 period_max_ms;
+};
+
+/*
+ * Fault counts and cpu time in a record are the increase since the previous
+ * record for the same task (or task set), not running totals. wss is the
+ * working set estimate in pages: the pages found referenced during the last
+ * complete sweep over the address space, 0 until a sweep completes or when
+ * the scan is off.
+ *
+ * A thread group registered with "G" counts as one task whose record covers
+ * all its threads. In MODE_PER_PID that record has tgid 0 like the record
+ * of any registered task, and is followed by one record per thread with pid
+ * the thread id and tgid the group. Thread records have wss 0, and summing
+ * records across pids must skip them.
+ */
+struct mp3_aggr_record {
+    __u64 timestamp;          // ns, CLOCK_MONOTONIC
+    unsigned long min_flt;
+    unsigned long maj_flt;
+    unsigned long cpu_time;   // us
+    unsigned long wss;        // pages
+};
+
+struct mp3_pid_record {
+    __u64 timestamp;          // ns, CLOCK_MONOTONIC
+    __s32 pid;
+    __u32 min_flt;
+    __u32 maj_flt;
+    __u32 cpu_time;           // us
+    __u32 wss;                // pages
+    __s32 tgid;               // group of a thread record, else 0
+};
+
+/*
+ * MODE_CPUS breaks the faults and cpu time of the registered tasks down by
+ * the CPU they happened on. Faults are counted where they are handled, and
+ * remote_flt counts the ones whose page is on another NUMA node than the
+ * CPU. A thread's cpu time goes to the CPU it last ran on. A tick writes a
+ * record for each CPU that faulted or ran a task, summing the records of a
+ * node gives the node's share.
+ */
+struct mp3_cpu_record {
+    __u64 timestamp;          // ns, CLOCK_MONOTONIC
+    __u32 cpu;
+    __u32 node;
+    __u32 min_flt;
+    __u32 maj_flt;
+    __u32 remote_flt;
+    __u32 cpu_time;           // us
+};
+
+#define FAULT_MAJOR 1
+
+struct mp3_fault_record {
+    __u64 timestamp;          // ns, CLOCK_MONOTONIC, when the fault completed
+    __u64 address;            // page aligned
+    __s32 pid;
+    __u32 flags;              // FAULT_MAJOR
+};
+
+/*
+ * Fault address heat, filled while fault sampling is on ("F RATE"). Each VMA
+ * a registered task faulted in gets an entry, found by pid and range, with
+ * its range split into HEAT_BUCKETS equal buckets. Entries are only
+ * appended, nr_vmas is bumped after the entry is filled in. Counters only
+ * grow, a reader may see them mid update.
+ */
+
+#define HEAT_VMAS 256
+#define HEAT_BUCKETS 64
+
+struct mp3_vma_heat {
+    __u64 start;
+    __u64 end;
+    __s32 pid;
+    __u32 minor;
+    __u32 major;
+    __u32 pad;
+    __u32 bucket_minor[HEAT_BUCKETS];
+    __u32 bucket_major[HEAT_BUCKETS];
+};
+
+struct mp3_heat {
+    __u32 rate;     // 1 of rate faults is sampled, 0 when off
+    __u32 nr_vmas;
+    __u64 seen;     // faults of registered tasks, brought up to date every sample
+    __u64 sampled;
+    __u64 no_slot;  // sampled faults in a VMA that didn't fit in the table
+    struct mp3_vma_heat vmas[HEAT_VMAS];
+};
+
+/*
+ * MODE_PACKED has record_size 1. Every entry starts with a tag, an unsigned
+ * LEB128 varint whose low 2 bits give the type, followed by varints:
+ *
+ *   PACKED_SYNC    tag = period_ms << 2, then timestamp, min_flt, maj_flt,
+ *                  cpu_time, wss. Sets the clock and the period for what
+ *                  follows.
+ *   PACKED_SAMPLE  tag = zigzag(timestamp - expected) << 2, then min_flt,
+ *                  maj_flt, cpu_time, wss. expected is the previous
+ *                  timestamp plus one period.
+ *   PACKED_IDLE    tag = ticks << 2. That many samples with all counters 0
+ *                  and wss unchanged, one period apart.
+ *
+ * Fields mean the same as in mp3_aggr_record. Idle ticks are reported at
+ * most a second late. An entry is only published once complete, and after
+ * lost data or missed ticks (overruns) the stream restarts with a
+ * PACKED_SYNC. So it does when /dev/node is opened, a reader joining a
+ * running stream starts timing at that sync. sequence and lost count
+ * samples, not bytes.
+ */
+
+#define PACKED_SAMPLE 0
+#define PACKED_IDLE   1
+#define PACKED_SYNC   2
+#define PACKED_VARINT_MAX 10  // bytes of a 64 bit varint
+#define PACKED_IDLE_MS 1000   // longest delay of an idle run
+
+/*
+ * Capture file written by record: a mp3_capture_header, then the data
+ * exactly as read from /dev/node starting at data_offset. sequence and lost
+ * cover the time of the capture.
+ */
+
+#define MP3_CAPTURE_MAGIC 0x6d703363  // "mp3c"
+
+struct mp3_capture_header {
+    __u32 magic;
+    __u32 version;      // MP3_BUF_VERSION of the records
+    __u32 mode;
+    __u32 record_size;
+    __u32 period_ms;    // at the start of the capture
+    __u32 pad;
+    __u64 data_offset;
+    __u64 data_size;
+    __u64 sequence;
+    __u64 lost;
+};
+
+#endif
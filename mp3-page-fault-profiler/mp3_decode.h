@@ -0,0 +1,194 @@
+#ifndef __MP3_DECODE_INCLUDE__
+#define __MP3_DECODE_INCLUDE__
+
+#include "mp3_buf.h"
+
+/*
+ * Userspace decoder for the records in the profiler buffer or in a capture
+ * file, shared by monitor and analyze. MODE_AGGREGATE, MODE_PER_PID and
+ * MODE_PACKED all come out as mp3_sample. So does MODE_CPUS, one sample per
+ * CPU record with pid -1 and wss 0. MODE_FAULTS holds no samples.
+ *
+ * A MODE_PACKED stream is checked as it is read: a varint longer than
+ * PACKED_VARINT_MAX bytes or running past the data, and an idle run longer
+ * than PACKED_IDLE_MS, can't have come from the module, so decoding stops
+ * there and -1 is returned. So is an unknown mode, or a record_size
+ * smaller than the record of its mode, since both come from the file.
+ * Entries before the first PACKED_SYNC have no clock and are skipped, a
+ * reader that joins a running stream starts at the sync the module writes
+ * for it.
+ */
+
+// One sample, pid is -1 for the aggregate modes
+struct mp3_sample {
+  __u64 timestamp;  // ns
+  __s64 pid;
+  __s64 tgid;       // thread records of a registered group, else 0
+  __u64 min_flt;
+  __u64 maj_flt;
+  __u64 cpu_time;   // us
+  __u64 wss;        // pages
+};
+
+// Clock of a MODE_PACKED stream, zero it before the first call for a stream
+struct mp3_decoder {
+  __u64 ts;
+  __u64 period_ns;
+  __u64 wss;
+};
+
+typedef void (*mp3_sample_fn)(void *arg, const struct mp3_sample *s);
+
+// Reads packed entries, wrapping at the end of the ring
+struct mp3_cursor {
+  const unsigned char *data;
+  __u64 size;
+  __u64 off;
+  __u64 left;  // bytes of the stream not read yet
+};
+
+// This function reads one varint into *v. It returns 0, or -1 when the varint is too long or truncated.
+static inline int mp3_get_varint(struct mp3_cursor *c, __u64 *v)
+{
+  int shift = 0, n = 0;
+  unsigned char b;
+
+  *v = 0;
+  do {
+    if(c->left == 0 || n++ == PACKED_VARINT_MAX)
+      return -1;
+    b = c->data[c->off];
+    if(++c->off == c->size)
+      c->off = 0;
+    c->left--;
+    *v |= (__u64) (b & 0x7f) << shift;
+    shift += 7;
+  } while(b & 0x80);
+  return 0;
+}
+
+static long mp3_decode_packed(struct mp3_decoder *d, const unsigned char *data, __u64 size,
+                              __u64 off, __u64 len, mp3_sample_fn fn, void *arg)
+{
+  struct mp3_cursor c;
+  struct mp3_sample s;
+  __u64 tag, z, n, period_ms;
+  long i = 0;
+
+  c.data = data;
+  c.size = size;
+  c.off = off;
+  c.left = len;
+  s.pid = -1;
+  s.tgid = 0;
+  while(c.left > 0){
+    if(mp3_get_varint(&c, &tag) < 0)
+      return -1;
+    if((tag & 3) == PACKED_IDLE){
+      // the module ends a run once it spans PACKED_IDLE_MS
+      period_ms = d->period_ns / 1000000 ? d->period_ns / 1000000 : 1;
+      if((tag >> 2) > (PACKED_IDLE_MS + period_ms - 1) / period_ms)
+        return -1;
+      s.min_flt = s.maj_flt = s.cpu_time = 0;
+      s.wss = d->wss;
+      for(n = d->period_ns ? tag >> 2 : 0; n > 0; n--, i++){
+        d->ts += d->period_ns;
+        s.timestamp = d->ts;
+        fn(arg, &s);
+      }
+    } else {
+      if((tag & 3) == PACKED_SYNC){
+        d->period_ns = (tag >> 2) * 1000000;
+        if(mp3_get_varint(&c, &d->ts) < 0)
+          return -1;
+      } else {
+        z = tag >> 2;
+        d->ts += d->period_ns + (__s64) ((z >> 1) ^ -(z & 1));
+      }
+      s.timestamp = d->ts;
+      if(mp3_get_varint(&c, &s.min_flt) < 0 || mp3_get_varint(&c, &s.maj_flt) < 0 ||
+         mp3_get_varint(&c, &s.cpu_time) < 0 || mp3_get_varint(&c, &s.wss) < 0)
+        return -1;
+      if(d->period_ns == 0)
+        continue;  // no sync yet
+      d->wss = s.wss;
+      fn(arg, &s);
+      i++;
+    }
+  }
+  return i;
+}
+
+// This function checks the layout a header or capture claims. It returns 0 if records of record_size bytes can be read as mode, else -1.
+static inline int mp3_check_layout(__u32 mode, __u32 record_size)
+{
+  __u32 need;
+
+  switch(mode){
+  case MODE_AGGREGATE: need = sizeof(struct mp3_aggr_record); break;
+  case MODE_PER_PID: need = sizeof(struct mp3_pid_record); break;
+  case MODE_FAULTS: need = sizeof(struct mp3_fault_record); break;
+  case MODE_CPUS: need = sizeof(struct mp3_cpu_record); break;
+  case MODE_PACKED: need = 1; break;
+  default: return -1;
+  }
+  return record_size < need ? -1 : 0;
+}
+
+// This function decodes the len bytes of records starting at offset off of a ring of size bytes and calls fn for every sample. It returns the number of samples, or -1 for an unknown layout or a corrupt MODE_PACKED stream.
+static long mp3_decode(struct mp3_decoder *d, const unsigned char *data, __u64 size, __u64 off,
+                       __u64 len, __u32 mode, __u32 record_size, mp3_sample_fn fn, void *arg)
+{
+  const struct mp3_aggr_record *a;
+  const struct mp3_pid_record *p;
+  const struct mp3_cpu_record *c;
+  struct mp3_sample s;
+  long i = 0;
+
+  if(mp3_check_layout(mode, record_size) < 0)
+    return -1;
+  if(mode == MODE_PACKED)
+    return mp3_decode_packed(d, data, size, off, len, fn, arg);
+  if(mode == MODE_FAULTS)
+    return 0;
+  for(; len >= record_size; len -= record_size, i++){
+    // a fixed size record never wraps around the end of the ring
+    if(off + record_size > size)
+      return -1;
+    if(mode == MODE_PER_PID){
+      p = (const struct mp3_pid_record *) (data + off);
+      s.timestamp = p->timestamp;
+      s.pid = p->pid;
+      s.tgid = p->tgid;
+      s.min_flt = p->min_flt;
+      s.maj_flt = p->maj_flt;
+      s.cpu_time = p->cpu_time;
+      s.wss = p->wss;
+    } else if(mode == MODE_CPUS){
+      c = (const struct mp3_cpu_record *) (data + off);
+      s.timestamp = c->timestamp;
+      s.pid = -1;
+      s.tgid = 0;
+      s.min_flt = c->min_flt;
+      s.maj_flt = c->maj_flt;
+      s.cpu_time = c->cpu_time;
+      s.wss = 0;
+    } else {
+      a = (const struct mp3_aggr_record *) (data + off);
+      s.timestamp = a->timestamp;
+      s.pid = -1;
+      s.tgid = 0;
+      s.min_flt = a->min_flt;
+      s.maj_flt = a->maj_flt;
+      s.cpu_time = a->cpu_time;
+      s.wss = a->wss;
+    }
+    fn(arg, &s);
+    off += record_size;
+    if(off == size)
+      off = 0;
+  }
+  return i;
+}
+
+#endif
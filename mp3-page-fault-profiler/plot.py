@@ -8,14 +8,22 @@ def read_raw_data(filename):
             data.append(list(map(lambda v: int(v), r)))
     return data
 
+# Rows from monitor are: time (ns) minor-faults major-faults cpu-time (us) wss (pages).
+# Older captures, like the profile*.data here, have no wss column and count
+# time and cpu time in jiffies.
+def is_legacy(data):
+    return len(data[0]) == 4
+
+# Cumulative counters, time in ms (jiffies for a legacy capture)
 def acc_data(data):
+    scale = 1 if is_legacy(data) else 1000000
     t0 = data[0][0]
-    cur = data[0][:]
+    cur = data[0][:4]
     new_data = [[0] + cur[1:]]
-    for t, a, b, c in data[1:]:
+    for t, a, b, c in (row[:4] for row in data[1:]):
         if a + b + c == 0:
             continue
-        cur[0] = t - t0
+        cur[0] = (t - t0) / scale
         cur[1] += a
         cur[2] += b
         cur[3] += c
@@ -30,7 +38,7 @@ def case_1(filename, title, description):
 
     plt.scatter(X, Y)
     plt.title(title + '\n' + description)
-    plt.xlabel('Time/jiffies')
+    plt.xlabel('Time/jiffies' if is_legacy(raw_data) else 'Time/ms')
     plt.ylabel('Page Fault')
     plt.show()
 
@@ -39,6 +47,8 @@ def get_cpu_util(filename):
     scanned_data = acc_data(raw_data)
     total_time = scanned_data[-1][0] - scanned_data[0][0]
     cpu_time = scanned_data[-1][-1]
+    if not is_legacy(raw_data):
+        cpu_time /= 1000  # us to ms
     return cpu_time / total_time
 
 def get_N(filename):
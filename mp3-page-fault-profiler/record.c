@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mp3_buf.h"
+
+#define PIPE_SIZE (1 << 20)  // bytes moved per splice()
+
+static volatile sig_atomic_t stop = 0;
+
+void on_signal(int sig)
+{
+  (void) sig;
+  stop = 1;
+}
+
+void usage(void)
+{
+  printf("Usage: ./record [-t <seconds>] <capture file>\n");
+  printf("\tStreams /dev/node into the capture file until interrupted, read it with ./monitor -r\n");
+}
+
+int main(int argc, char* argv[])
+{
+  struct mp3_buf_header *hdr;
+  struct mp3_capture_header cap;
+  struct sigaction sa;
+  __u64 seq0, lost0;
+  ssize_t n, m;
+  int dev_fd, out_fd, p[2], opt;
+  unsigned int seconds = 0;
+
+  while((opt = getopt(argc, argv, "t:h")) != -1){
+    if(opt == 't'){
+      seconds = atoi(optarg);
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if(optind != argc - 1){
+    usage();
+    return 1;
+  }
+
+  // The data is read() from the device, the header page is only mapped for the counters
+  if((dev_fd = open("/dev/node", O_RDONLY)) < 0){
+    printf("file open error. /dev/node\n");
+    return 1;
+  }
+  hdr = mmap(0, getpagesize(), PROT_READ, MAP_SHARED, dev_fd, 0);
+  if(hdr == MAP_FAILED || hdr->magic != MP3_BUF_MAGIC || hdr->version != MP3_BUF_VERSION){
+    printf("unknown buffer layout, rebuild record against this module\n");
+    return 1;
+  }
+  if((out_fd = open(argv[optind], O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0){
+    printf("file open error. %s\n", argv[optind]);
+    return 1;
+  }
+  if(pipe(p) < 0){
+    printf("pipe error.\n");
+    return 1;
+  }
+  fcntl(p[1], F_SETPIPE_SZ, PIPE_SIZE);
+
+  memset(&cap, 0, sizeof(cap));
+  cap.magic = MP3_CAPTURE_MAGIC;
+  cap.version = MP3_BUF_VERSION;
+  cap.mode = hdr->mode;
+  cap.record_size = hdr->record_size;
+  cap.period_ms = hdr->period_ms;
+  cap.data_offset = sizeof(cap);
+  if(write(out_fd, &cap, sizeof(cap)) != sizeof(cap)){
+    printf("write error. %s\n", argv[optind]);
+    return 1;
+  }
+  seq0 = hdr->sequence;
+  lost0 = hdr->lost;
+
+  // No SA_RESTART, so a signal breaks the blocking read in the module
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGALRM, &sa, NULL);
+  alarm(seconds);
+
+  // device -> pipe -> file, the data never passes through this process
+  while(!stop){
+    n = splice(dev_fd, NULL, p[1], NULL, PIPE_SIZE, SPLICE_F_MOVE);
+    if(n < 0){
+      if(errno == EINTR)
+        continue;
+      printf("splice error: %s\n", strerror(errno));
+      break;
+    }
+    while(n > 0){
+      m = splice(p[0], NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+      if(m < 0 && errno == EINTR)
+        continue;
+      if(m <= 0){
+        printf("splice error: %s\n", strerror(errno));
+        stop = 1;
+        break;
+      }
+      n -= m;
+      cap.data_size += m;
+    }
+  }
+
+  cap.sequence = hdr->sequence - seq0;
+  cap.lost = hdr->lost - lost0;
+  pwrite(out_fd, &cap, sizeof(cap), 0);
+  fprintf(stderr, "recorded %llu bytes, %llu of %llu samples lost\n",
+          (unsigned long long) cap.data_size, (unsigned long long) cap.lost,
+          (unsigned long long) cap.sequence);
+
+  close(out_fd);
+  munmap(hdr, getpagesize());
+  close(dev_fd);
+  return 0;
+}
@@ -1,119 +1,378 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/syscall.h>
 #include <unistd.h>
-#include <stdio.h>
-#include <unistd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#define PAGE 4096
+#define MB (1024 * 1024)
+#define CHASE_SLOTS 64  // places a chase pointer can sit in a page, one per cache line
+
+/*
+ * Access patterns
+ *   R  random byte
+ *   T  temporal locality: 20% random, otherwise a short hop from the last address (also L)
+ *   S  sequential
+ *   D  strided, -d bytes apart
+ *   Z  Zipfian over pages, -z skew, hot pages scattered over the buffer
+ *   P  pointer chase through all pages in one random cycle, each load depends on the last
+ */
+
+struct config {
+  long msize;         // MB
+  char pattern;
+  long naccess;       // per thread and iteration
+  int iterations;
+  int threads;
+  long sleep_ms;
+  long stride;
+  double zipf_theta;
+  int hugepage;
+  int advice;
+  int do_register;
+};
 
-#define N_ITERATION 20
+struct worker {
+  pthread_t thread;
+  int id;
+  unsigned long long seed;
+  double seconds;     // spent accessing, without the sleeps
+  unsigned long long checksum;
+};
+
+static struct config cfg = {
+  .iterations = 20,
+  .threads = 1,
+  .sleep_ms = 1000,
+  .stride = PAGE,
+  .zipf_theta = 0.99,
+  .advice = -1,
+  .do_register = 1,
+};
+static char *buffer;
+static size_t buf_size;
+static size_t npages;
+static double *zipf_cdf;       // cdf[i] = P(rank <= i)
+static unsigned int *zipf_page; // rank -> page
+static pthread_barrier_t barrier;
+static volatile unsigned long long sink;
+
+// xorshift64*, one state per thread, so threads don't share the rand() lock
+static inline unsigned long long next_rand(unsigned long long *s)
+{
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717ULL;
+}
 
-char *buffer[1024];
+static inline size_t rand_below(unsigned long long *s, size_t n)
+{
+  return next_rand(s) % n;
+}
 
-int msize;
+double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-// This function emualtes a random memory access
-void rand_access()
+void mp3_command(char action, pid_t tid)
 {
-  int target;
-  int blk;
-
-  target = rand() % (msize * 1024*1024);
-  if(target<0)
-    target *= -1;
-  blk = target / 1024/1024;
-  buffer[blk][target-blk*1024*1024] = '*';
+  FILE *fp = fopen("/proc/mp3/status", "w");
+  if(fp == NULL){
+    printf("fail to open /proc/mp3/status, is the module loaded?\n");
+    return;
+  }
+  fprintf(fp, "%c %d", action, tid);
+  fclose(fp);
 }
 
-// This function emualtes a memory access that has a temporal locality
-int local_access(int addr)
+// This function maps the buffer, with hugepages if asked and available, and applies the madvise hint.
+int alloc_buffer(void)
 {
-  if(rand() < 0){
-    return addr + 1;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  buf_size = (size_t) cfg.msize * MB;
+  npages = buf_size / PAGE;
+  buffer = MAP_FAILED;
+  if(cfg.hugepage){
+    buffer = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if(buffer == MAP_FAILED)
+      printf("no hugetlb pages reserved, falling back to transparent hugepages\n");
   }
-  else{
-    return addr + rand() % 300;
+  if(buffer == MAP_FAILED){
+    buffer = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if(buffer == MAP_FAILED)
+      return -1;
+    if(cfg.hugepage)
+      madvise(buffer, buf_size, MADV_HUGEPAGE);
   }
+  if(cfg.advice >= 0 && madvise(buffer, buf_size, cfg.advice) != 0)
+    printf("madvise failed, ignoring the hint\n");
+  return 0;
 }
 
-int main(int argc, char* argv[])
+// The Zipf cdf over page ranks, and a random assignment of ranks to pages. It returns -1 when out of memory.
+int setup_zipf(unsigned long long *seed)
 {
-  char cmd[120];
-  pid_t mypid;
-  int i, j, k;
-  int locality;
-  int naccess;
-
-  if(argc<4){
-    printf("usage: work <memsize in MB> <locality: R for Random or T for Temporal> <# of memory accesses per iteration>");
+  double sum = 0;
+  size_t i, j;
+  unsigned int t;
+
+  zipf_cdf = malloc(sizeof(double) * npages);
+  zipf_page = malloc(sizeof(unsigned int) * npages);
+  if(!zipf_cdf || !zipf_page)
     return -1;
+  for(i = 0; i < npages; i++){
+    sum += 1.0 / pow(i + 1, cfg.zipf_theta);
+    zipf_cdf[i] = sum;
+    zipf_page[i] = i;
   }
+  for(i = 0; i < npages; i++)
+    zipf_cdf[i] /= sum;
+  for(i = npages - 1; i > 0; i--){
+    j = rand_below(seed, i + 1);
+    t = zipf_page[i];
+    zipf_page[i] = zipf_page[j];
+    zipf_page[j] = t;
+  }
+  return 0;
+}
 
-  msize = atoi(argv[1]);
-  if(msize>1024 || msize<1){
-    printf("memsize shall be between 1 and 1024\n");
-    return -1;
+static inline size_t zipf_page_of(unsigned long long *s)
+{
+  double u = (next_rand(s) >> 11) * (1.0 / (1ULL << 53));
+  size_t lo = 0, hi = npages - 1, mid;
+
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(zipf_cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  return zipf_page[lo];
+}
+
+static inline char **chase_slot(size_t page)
+{
+  return (char **) (buffer + page * PAGE + (page * 7919 % CHASE_SLOTS) * (PAGE / CHASE_SLOTS));
+}
 
-  locality = (argv[2][0]=='R')?0:1;
+// Link all pages into one random cycle (Sattolo), the pointer sits at a different line of each page. It returns -1 when out of memory.
+int setup_chase(unsigned long long *seed)
+{
+  size_t *order = malloc(sizeof(size_t) * npages);
+  size_t i, j, t;
 
-  naccess = atoi(argv[3]);
-  if(naccess<1){
-    printf("naccess shall be >=1\n");
+  if(!order)
     return -1;
+  for(i = 0; i < npages; i++)
+    order[i] = i;
+  for(i = npages - 1; i > 0; i--){
+    j = rand_below(seed, i);
+    t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  for(i = 0; i < npages; i++)
+    *chase_slot(order[i]) = (char *) chase_slot(order[(i + 1) % npages]);
+  free(order);
+  return 0;
+}
+
+// This function performs one iteration of accesses. It returns a value depending on what was read, so the loads can't be dropped.
+unsigned long long run_iteration(struct worker *w, size_t *pos)
+{
+  unsigned long long *s = &w->seed;
+  unsigned long long sum = 0;
+  char **p;
+  long j;
+
+  switch(cfg.pattern){
+  case 'R':
+    for(j = 0; j < cfg.naccess; j++)
+      buffer[rand_below(s, buf_size)]++;
+    break;
+  case 'T':
+    for(j = 0; j < cfg.naccess; j++){
+      if(rand_below(s, 10) < 2)
+        *pos = rand_below(s, buf_size);
+      else
+        *pos = (*pos + rand_below(s, 300)) % buf_size;
+      buffer[*pos]++;
+    }
+    break;
+  case 'S':
+  case 'D':
+    for(j = 0; j < cfg.naccess; j++){
+      buffer[*pos]++;
+      *pos += cfg.pattern == 'S' ? 1 : cfg.stride;
+      // a stride may be larger than the buffer
+      *pos %= buf_size;
+    }
+    break;
+  case 'Z':
+    for(j = 0; j < cfg.naccess; j++)
+      buffer[zipf_page_of(s) * PAGE + rand_below(s, PAGE)]++;
+    break;
+  case 'P':
+    p = (char **) *pos;
+    for(j = 0; j < cfg.naccess; j++)
+      p = (char **) *p;
+    *pos = (size_t) p;
+    sum = (unsigned long long) p;
+    break;
   }
+  return sum;
+}
+
+void *run_worker(void *arg)
+{
+  struct worker *w = arg;
+  pid_t tid = syscall(__NR_gettid);
+  size_t pos;
+  double start;
+  int k;
+
+  // start the threads at different places
+  if(cfg.pattern == 'P')
+    pos = (size_t) chase_slot(rand_below(&w->seed, npages));
+  else
+    pos = (size_t) w->id * (buf_size / cfg.threads);
 
-  printf("A work prcess starts (configuration: %d %d %d)\n", msize, locality, naccess); 
+  for(k = 0; k < cfg.iterations; k++){
+    pthread_barrier_wait(&barrier);
+    start = now();
+    w->checksum += run_iteration(w, &pos);
+    w->seconds += now() - start;
+    if(w->id == 0)
+      printf("[%d] %d iteration\n", tid, k);
+    if(cfg.sleep_ms > 0 && k < cfg.iterations - 1)
+      usleep(cfg.sleep_ms * 1000);
+  }
+  return NULL;
+}
+
+void usage(void)
+{
+  printf("usage: work [options] <memsize in MB> <pattern> <# of memory accesses per iteration>\n");
+  printf("\tpattern: R random, T (or L) temporal locality, S sequential, D strided,\n");
+  printf("\t         Z Zipfian, P pointer chase\n");
+  printf("\t-t <threads>       worker threads, each does the accesses (default 1)\n");
+  printf("\t-n <iterations>    (default 20)\n");
+  printf("\t-s <ms>            sleep between iterations (default 1000)\n");
+  printf("\t-d <bytes>         stride of D (default 4096)\n");
+  printf("\t-z <theta>         skew of Z (default 0.99)\n");
+  printf("\t-H                 use hugepages\n");
+  printf("\t-a <r|s|w|n>       madvise MADV_RANDOM, SEQUENTIAL, WILLNEED or NOHUGEPAGE\n");
+  printf("\t-N                 don't register with MP3\n");
+}
 
-  // 1. Register itself to the MP3 kernel module for profiling.
-  mypid = syscall(__NR_gettid);
-  sprintf(cmd, "echo 'R %u'>//proc/mp3/status", mypid);
-  system(cmd);
+int main(int argc, char* argv[])
+{
+  struct worker *workers;
+  unsigned long long seed = time(NULL) ^ getpid(), checksum = 0;
+  double seconds = 0, total;
+  int opt, i;
 
-  // 2. Allocate memory blocks
-  for(i=0; i<msize; i++){
-    buffer[i] = malloc(1024*1024);
-    if(buffer[i] == NULL){
-      for(i--; i>=0; i--)
-        free(buffer[i]);
-      printf("Out of memory error! (failed at %dMB)\n", i);
+  while((opt = getopt(argc, argv, "t:n:s:d:z:Ha:Nh")) != -1){
+    switch(opt){
+    case 't': cfg.threads = atoi(optarg); break;
+    case 'n': cfg.iterations = atoi(optarg); break;
+    case 's': cfg.sleep_ms = atol(optarg); break;
+    case 'd': cfg.stride = atol(optarg); break;
+    case 'z': cfg.zipf_theta = atof(optarg); break;
+    case 'H': cfg.hugepage = 1; break;
+    case 'a':
+      cfg.advice = optarg[0] == 'r' ? MADV_RANDOM : optarg[0] == 's' ? MADV_SEQUENTIAL :
+                   optarg[0] == 'w' ? MADV_WILLNEED : optarg[0] == 'n' ? MADV_NOHUGEPAGE : -1;
+      break;
+    case 'N': cfg.do_register = 0; break;
+    default:
+      usage();
       return -1;
     }
   }
+  if(argc - optind < 3){
+    usage();
+    return -1;
+  }
 
-  // 3. Access allocated memory blocks using the specified access policy
-  int addr = 0;
-  for (k=0;k<N_ITERATION; k++){
-     printf("[%d] %d iteration\n", mypid, k);
-     if(!locality){
-       for(j=0; j<naccess; j++){
-         rand_access();
-       }
-     }
-     else{
-       for(j=0; j<naccess; j++){
-         int locality = rand() % 10;
-         if(locality > -2 && locality < 2){ /* random access */
-           rand_access();
-         }
-         else{ /* local access */
-           addr = local_access(addr);
-	 }
-       }
-     }
-     sleep(1);
-  }
-  
-  // 4. Free memory blocks
-  for(i=0; i<msize; i++){
-    free(buffer[i]);
-  }
-
-  // 5. Unregister itself to stop the profiling
-  sprintf(cmd, "echo 'U %u'>//proc/mp3/status", mypid);
-  system(cmd);
-}
+  cfg.msize = atol(argv[optind]);
+  if(cfg.msize>1024 || cfg.msize<1){
+    printf("memsize shall be between 1 and 1024\n");
+    return -1;
+  }
+  cfg.pattern = argv[optind + 1][0] == 'L' ? 'T' : argv[optind + 1][0];
+  if(strchr("RTSDZP", cfg.pattern) == NULL){
+    printf("unknown pattern: %s\n", argv[optind + 1]);
+    return -1;
+  }
+  cfg.naccess = atol(argv[optind + 2]);
+  if(cfg.naccess<1){
+    printf("naccess shall be >=1\n");
+    return -1;
+  }
+  if(cfg.threads < 1 || cfg.iterations < 1 || cfg.stride < 1){
+    usage();
+    return -1;
+  }
+
+  printf("A work process starts (configuration: %ld %c %ld, %d thread(s))\n",
+         cfg.msize, cfg.pattern, cfg.naccess, cfg.threads);
+
+  // 1. Allocate memory, the setup of Z and P is done before anything is profiled
+  if(alloc_buffer() != 0){
+    printf("Out of memory error! (%ldMB)\n", cfg.msize);
+    return -1;
+  }
+  if((cfg.pattern == 'Z' && setup_zipf(&seed) != 0) ||
+     (cfg.pattern == 'P' && setup_chase(&seed) != 0)){
+    printf("Out of memory error! (pattern %c)\n", cfg.pattern);
+    return -1;
+  }
 
+  // 2. Register the thread group to MP3, it finds the workers itself, and access the memory from all threads
+  if(cfg.do_register)
+    mp3_command('G', getpid());
+  pthread_barrier_init(&barrier, NULL, cfg.threads);
+  workers = calloc(cfg.threads, sizeof(struct worker));
+  for(i = 0; i < cfg.threads; i++){
+    workers[i].id = i;
+    workers[i].seed = next_rand(&seed) | 1;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  for(i = 0; i < cfg.threads; i++){
+    pthread_join(workers[i].thread, NULL);
+    if(workers[i].seconds > seconds)
+      seconds = workers[i].seconds;
+    checksum += workers[i].checksum;
+  }
+  if(cfg.do_register)
+    mp3_command('U', getpid());
+
+  // 3. Report the achieved throughput, the time the slowest thread spent accessing
+  total = (double) cfg.naccess * cfg.iterations * cfg.threads;
+  printf("pattern,threads,memsize_mb,accesses,seconds,accesses_per_sec\n");
+  printf("%c,%d,%ld,%.0f,%.3f,%.0f\n", cfg.pattern, cfg.threads, cfg.msize, total, seconds,
+         seconds > 0 ? total / seconds : 0);
+  sink = checksum;
+
+  // 4. Free memory
+  munmap(buffer, buf_size);
+  free(workers);
+  free(zipf_cdf);
+  free(zipf_page);
+  return 0;
+}
@@ -9,56 +9,165 @@
 #include <linux/binfmts.h>
 #include "mp4_given.h"
 
+/* label of an inode that hasn't been read from the xattr yet */
+#define MP4_SID_UNKNOWN -1
+
 /**
- * get_inode_sid - Get the inode mp4 security label id
+ * Cached mp4 label of an inode
+ * @sid: the label, MP4_SID_UNKNOWN until read
+ * @gen: bumped whenever security.mp4 changes, so that a lookup that read
+ *	 the old value doesn't cache it
+ * @removing: security.mp4 is being removed. There is no hook after the
+ *	 removal, so until a lookup finds the label gone, or it is set
+ *	 again, a label that is still there isn't cached
+ * @lock: protects the update of all three
+ */
+struct mp4_inode_security {
+	int sid;
+	unsigned int gen;
+	int removing;
+	spinlock_t lock;
+};
+
+/**
+ * read_inode_sid - Read the inode mp4 security label id from its xattr
  *
  * @inode: the input inode
+ * @sid: set to the label, MP4_NO_ACCESS when there is none or it can't
+ *	 be read
  *
- * @return the inode's security id if found.
+ * @return 0 if a label was read, 1 if the inode has no security.mp4 or no
+ * xattrs at all; both are definitive. A negative error if reading failed
+ * for another reason (no dentry, out of memory, I/O), then @sid is only
+ * the fallback and must not be cached.
  *
  */
-static int get_inode_sid(struct inode *inode)
+static int read_inode_sid(struct inode *inode, int *sid)
 {
 	int buflen = 256;
 	char *buf;
 	struct dentry *dentry;
 	int ret;
-	int sid = MP4_NO_ACCESS;
 
+	*sid = MP4_NO_ACCESS;
 	if (!inode->i_op->getxattr) {
-		return sid;
+		return 1;
 	}
 
 	dentry = d_find_alias(inode);
 
 	if (!dentry) {
-		return sid;
+		return -ENOENT;
 	}
 
-	buf = kmalloc(buflen, GFP_KERNEL);
-	memset(buf, 0, buflen); // reall needed? set the buf[len] to '\0' should be enough
+	buf = kzalloc(buflen, GFP_KERNEL);
+	if (!buf) {
+		dput(dentry);
+		return -ENOMEM;
+	}
 
-	ret = inode->i_op->getxattr(dentry, XATTR_NAME_MP4, buf, buflen);
+	/* leave room for the terminating NUL */
+	ret = inode->i_op->getxattr(dentry, XATTR_NAME_MP4, buf, buflen - 1);
 
-	if (ret == -ERANGE) { // don't understand how ERANGE works
+	if (ret == -ERANGE) {
+		/* longer than buf, ask for the size and read it again */
 		kfree(buf);
 		ret = inode->i_op->getxattr(dentry, XATTR_NAME_MP4, NULL, 0);
 		if (ret < 0) {
 			dput(dentry);
-			return sid;
+			return ret == -ENODATA || ret == -EOPNOTSUPP ? 1 : ret;
+		}
+		buflen = ret + 1;
+		buf = kzalloc(buflen, GFP_KERNEL);
+		if (!buf) {
+			dput(dentry);
+			return -ENOMEM;
 		}
-		buf = kmalloc(ret + 1, GFP_KERNEL);
-		ret = inode->i_op->getxattr(dentry, XATTR_NAME_MP4, buf, buflen);
-		buf[ret] = 0;
+		ret = inode->i_op->getxattr(dentry, XATTR_NAME_MP4, buf, buflen - 1);
 	}
 	dput(dentry);
 	if (ret > 0) {
-		sid = __cred_ctx_to_sid(buf);
+		*sid = __cred_ctx_to_sid(buf);
 	}
 	kfree(buf);
+	if (ret < 0) {
+		/* no label is a definitive answer, anything else may change */
+		return ret == -ENODATA || ret == -EOPNOTSUPP ? 1 : ret;
+	}
+	return 0;
+}
+
+/**
+ * get_inode_sid - Get the inode mp4 security label id
+ *
+ * @inode: the input inode
+ *
+ * The label is read from the xattr once and cached in the inode's blob
+ * until security.mp4 changes. Only a definitive read is cached, after a
+ * failed one the inode stays MP4_SID_UNKNOWN and is read again next time.
+ * While the label is being removed only its absence is cached.
+ * Inodes allocated before the module was registered have no blob and are
+ * read every time.
+ *
+ * @return the inode's security id if found.
+ *
+ */
+static int get_inode_sid(struct inode *inode)
+{
+	struct mp4_inode_security *isec = inode->i_security;
+	unsigned int gen;
+	int sid, ret;
+
+	if (!isec) {
+		read_inode_sid(inode, &sid);
+		return sid;
+	}
+
+	sid = READ_ONCE(isec->sid);
+	if (sid != MP4_SID_UNKNOWN) {
+		return sid;
+	}
+
+	spin_lock(&isec->lock);
+	gen = isec->gen;
+	spin_unlock(&isec->lock);
+
+	ret = read_inode_sid(inode, &sid);
+	if (ret < 0) {
+		return sid;
+	}
+
+	spin_lock(&isec->lock);
+	if (isec->gen == gen && (!isec->removing || ret == 1)) {
+		WRITE_ONCE(isec->sid, sid);
+		isec->removing = 0;
+	}
+	spin_unlock(&isec->lock);
 	return sid;
 }
 
+/**
+ * set_inode_sid - Set the cached label of an inode
+ *
+ * @inode: the inode
+ * @sid: the label, MP4_SID_UNKNOWN to read it again on the next lookup
+ *
+ */
+static void set_inode_sid(struct inode *inode, int sid)
+{
+	struct mp4_inode_security *isec = inode->i_security;
+
+	if (!isec) {
+		return;
+	}
+
+	spin_lock(&isec->lock);
+	isec->gen++;
+	isec->removing = 0;
+	WRITE_ONCE(isec->sid, sid);
+	spin_unlock(&isec->lock);
+}
+
 /**
  * mp4_cred_alloc_blank - Allocate a blank mp4 security label
  *
@@ -193,9 +302,11 @@ static int mp4_inode_init_security(struct inode *inode, struct inode *dir,
 			if (S_ISDIR(inode->i_mode)) {
 				*value = kstrdup("dir-write", GFP_KERNEL);
 				*len = 10;
+				set_inode_sid(inode, MP4_RW_DIR);
 			} else {
 				*value = kstrdup("read-write", GFP_KERNEL);
 				*len = 11;
+				set_inode_sid(inode, MP4_READ_WRITE);
 			}
 			return 0;
 		} else if (printk_ratelimit()) {
@@ -206,6 +317,115 @@ static int mp4_inode_init_security(struct inode *inode, struct inode *dir,
 	return -EOPNOTSUPP;
 }
 
+/**
+ * mp4_inode_alloc_security - Allocate the security label of an inode
+ *
+ * @inode: the new inode
+ *
+ * The label starts unknown and is read on the first lookup.
+ *
+ * returns 0 on success, -ENOMEM if no memory
+ *
+ */
+static int mp4_inode_alloc_security(struct inode *inode)
+{
+	struct mp4_inode_security *isec;
+
+	isec = kmalloc(sizeof(struct mp4_inode_security), GFP_NOFS);
+	if (!isec) {
+		return -ENOMEM;
+	}
+
+	isec->sid = MP4_SID_UNKNOWN;
+	isec->gen = 0;
+	isec->removing = 0;
+	spin_lock_init(&isec->lock);
+	inode->i_security = isec;
+	return 0;
+}
+
+/**
+ * mp4_inode_free_security - Free the security label of an inode
+ *
+ * @inode: the inode being destroyed
+ *
+ */
+static void mp4_inode_free_security(struct inode *inode)
+{
+	kfree(inode->i_security);
+	inode->i_security = NULL;
+}
+
+/**
+ * mp4_inode_setxattr - Forget the cached label before security.mp4 changes
+ *
+ * @dentry: the object
+ * @name: the attribute name
+ * @value: unused
+ * @size: unused
+ * @flags: unused
+ *
+ * returns the verdict of the capability check, which a module providing
+ * this hook has to make itself
+ *
+ */
+static int mp4_inode_setxattr(struct dentry *dentry, const char *name,
+			      const void *value, size_t size, int flags)
+{
+	if (strcmp(name, XATTR_NAME_MP4) == 0) {
+		set_inode_sid(d_backing_inode(dentry), MP4_SID_UNKNOWN);
+	}
+	return cap_inode_setxattr(dentry, name, value, size, flags);
+}
+
+/**
+ * mp4_inode_post_setxattr - Forget the cached label after security.mp4 changed
+ *
+ * @dentry: the object
+ * @name: the attribute name
+ * @value: unused
+ * @size: unused
+ * @flags: unused
+ *
+ * A lookup between the two hooks may have read the old label.
+ *
+ */
+static void mp4_inode_post_setxattr(struct dentry *dentry, const char *name,
+				    const void *value, size_t size, int flags)
+{
+	if (strcmp(name, XATTR_NAME_MP4) == 0) {
+		set_inode_sid(d_backing_inode(dentry), MP4_SID_UNKNOWN);
+	}
+}
+
+/**
+ * mp4_inode_removexattr - Forget the cached label when security.mp4 is removed
+ *
+ * @dentry: the object
+ * @name: the attribute name
+ *
+ * There is no post hook for removal, so a lookup before the attribute is
+ * actually gone would cache the old label for good. The inode is marked
+ * removing instead, see struct mp4_inode_security.
+ *
+ * returns the verdict of the capability check, which a module providing
+ * this hook has to make itself
+ *
+ */
+static int mp4_inode_removexattr(struct dentry *dentry, const char *name)
+{
+	struct mp4_inode_security *isec = d_backing_inode(dentry)->i_security;
+
+	if (strcmp(name, XATTR_NAME_MP4) == 0 && isec) {
+		spin_lock(&isec->lock);
+		isec->gen++;
+		isec->removing = 1;
+		WRITE_ONCE(isec->sid, MP4_SID_UNKNOWN);
+		spin_unlock(&isec->lock);
+	}
+	return cap_inode_removexattr(dentry, name);
+}
+
 /**
  * mp4_has_permission - Check if subject has permission to an object
  *
@@ -292,6 +512,25 @@ static int mp4_inode_permission(struct inode *inode, int mask)
 		return 0;
 	}
 
+	blob = current_security();
+	if (blob) {
+		ssid = blob->mp4_flags;
+	}
+
+	if (ssid != MP4_TARGET_SID && S_ISDIR(inode->i_mode)) {
+		return 0;
+	}
+
+	osid = get_inode_sid(inode);
+	access_code = mp4_has_permission(ssid, osid, mask);
+	if (!access_code) {
+		return 0;
+	}
+
+	/*
+	 * Skipped paths are always granted, so the path is only looked up
+	 * for a denial
+	 */
 	dentry = d_find_alias(inode);
 	if (!dentry) {
 		if (printk_ratelimit()) {
@@ -301,30 +540,20 @@ static int mp4_inode_permission(struct inode *inode, int mask)
 	}
 
 	buf = kmalloc(buflen, GFP_KERNEL);
-	path = dentry_path_raw(dentry, buf, buflen);
-	if (path && mp4_should_skip_path(path)) {
+	if (!buf) {
 		dput(dentry);
-		kfree(buf);
-		return 0;
+		return access_code;
 	}
+	path = dentry_path_raw(dentry, buf, buflen);
 	dput(dentry);
-
-	blob = current_security();
-	if (blob) {
-		ssid = blob->mp4_flags;
-	}
-	osid = get_inode_sid(inode);
-
-	if (ssid != MP4_TARGET_SID && S_ISDIR(inode->i_mode)) {
+	if (!IS_ERR(path) && mp4_should_skip_path(path)) {
 		kfree(buf);
 		return 0;
 	}
 
-	access_code = mp4_has_permission(ssid, osid, mask);
-	if (access_code) {
-		// deny
-		pr_alert("access denied, ssid: %d, osid: %d, mask: %d, path: %s\n", ssid, osid, mask, path);
-	}
+	// deny
+	pr_alert("access denied, ssid: %d, osid: %d, mask: %d, path: %s\n", ssid, osid, mask,
+		 IS_ERR(path) ? "?" : path);
 	kfree(buf);
 	return access_code;
 }
@@ -340,6 +569,13 @@ static struct security_hook_list mp4_hooks[] = {
 	LSM_HOOK_INIT(inode_init_security, mp4_inode_init_security),
 	LSM_HOOK_INIT(inode_permission, mp4_inode_permission),
 
+	/* inode label cache, dropped when security.mp4 changes */
+	LSM_HOOK_INIT(inode_alloc_security, mp4_inode_alloc_security),
+	LSM_HOOK_INIT(inode_free_security, mp4_inode_free_security),
+	LSM_HOOK_INIT(inode_setxattr, mp4_inode_setxattr),
+	LSM_HOOK_INIT(inode_post_setxattr, mp4_inode_post_setxattr),
+	LSM_HOOK_INIT(inode_removexattr, mp4_inode_removexattr),
+
 	/*
 	 * setting the credentials subjective security label when laucnhing a
 	 * binary